@@ -0,0 +1,220 @@
+#!/bin/bash
+#
+# Strong/weak scaling study of hankelhacker.
+#
+# Runs every dimension x shift x thread count a number of times, picks the phase times (and the
+# total) out of each run, and writes the median, spread, speedup and parallel efficiency against
+# the 1-thread runs to <out>.csv and <out>.json. The output of every run goes to <out>.log.
+#
+# Strong scaling keeps each dimension as given. Weak scaling grows it with the thread count, by
+# the cube root since the dense inversion is O(n^3), so that each thread has about as much to do;
+# its efficiency is then T(1) / T(p) rather than T(1) / (p T(p)).
+#
+# Given a baseline (a CSV written by an earlier study), every median more than --tolerance percent
+# (and --floor seconds) slower than the baseline's is reported, and the exit status is 2.
+
+usage() {
+    cat >&2 <<EOF
+Usage: scaling.sh [options] [-- <hankelhacker options>]
+Options:
+  --dims=<d1,d2,...>     dimensions (with --weak, at 1 thread) (default 100,200,300)
+  --shifts=<s1,s2,...>   shifts (default 4096)
+  --threads=<t1,t2,...>  thread counts, 1 is always added (default 1, 2, 4, ... up to nproc)
+  --trials=<n>           runs of each configuration (default 3)
+  --weak                 weak scaling instead of strong
+  --out=<prefix>         where the results go (default scaling)
+  --baseline=<csv>       report regressions against an earlier study's CSV
+  --tolerance=<percent>  slowdown allowed against the baseline (default 10)
+  --floor=<seconds>      slowdown always allowed, for phases too short to time (default 0.05)
+  --binary=<path>        hankelhacker to run (default build/bin/hankelhacker)
+hankelhacker options default to --arith=fixed --solver=dense --verify=0, which run the phases
+being timed and nothing else.
+EOF
+    exit 1
+}
+
+DIMS=100,200,300
+SHIFTS=4096
+THREADS=
+TRIALS=3
+MODE=strong
+OUT=scaling
+BASELINE=
+TOLERANCE=10
+FLOOR=0.05
+BINARY=build/bin/hankelhacker
+OPTIONS=(--arith=fixed --solver=dense --verify=0)
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --dims=*)      DIMS="${1#*=}" ;;
+        --shifts=*)    SHIFTS="${1#*=}" ;;
+        --threads=*)   THREADS="${1#*=}" ;;
+        --trials=*)    TRIALS="${1#*=}" ;;
+        --weak)        MODE=weak ;;
+        --out=*)       OUT="${1#*=}" ;;
+        --baseline=*)  BASELINE="${1#*=}" ;;
+        --tolerance=*) TOLERANCE="${1#*=}" ;;
+        --floor=*)     FLOOR="${1#*=}" ;;
+        --binary=*)    BINARY="${1#*=}" ;;
+        --)            shift; OPTIONS=("$@"); break ;;
+        *)             usage ;;
+    esac
+    shift
+done
+
+if [ ! -x "$BINARY" ]; then
+    echo "Error: $BINARY is not there, build it first or give --binary" >&2
+    exit 1
+fi
+if [ -n "$BASELINE" ] && [ ! -r "$BASELINE" ]; then
+    echo "Error: Can't read baseline $BASELINE" >&2
+    exit 1
+fi
+
+IFS=, read -ra DIM_LIST <<<"$DIMS"
+IFS=, read -ra SHIFT_LIST <<<"$SHIFTS"
+
+# Powers of 2 up to the hardware threads, and all of them
+if [ -z "$THREADS" ]; then
+    PROCS=$(nproc)
+    THREADS=1
+    for ((t = 2; t < PROCS; t *= 2)); do
+        THREADS="$THREADS,$t"
+    done
+    [ "$PROCS" -gt 1 ] && THREADS="$THREADS,$PROCS"
+fi
+IFS=, read -ra THREAD_LIST <<<"1,$THREADS"
+THREAD_LIST=($(printf '%s\n' "${THREAD_LIST[@]}" | sort -nu))
+
+RAW=$(mktemp)
+trap 'rm -f "$RAW"' EXIT
+: >"$OUT.log"
+
+# One line per phase per run: mode, base dimension, dimension, shift, threads, phase, seconds
+for base in "${DIM_LIST[@]}"; do
+    for shift in "${SHIFT_LIST[@]}"; do
+        for threads in "${THREAD_LIST[@]}"; do
+            dim=$base
+            if [ "$MODE" = weak ]; then
+                dim=$(awk -v b="$base" -v t="$threads" 'BEGIN { printf "%d", b * exp(log(t) / 3) + 0.5 }')
+            fi
+
+            for ((trial = 1; trial <= TRIALS; trial++)); do
+                echo "dim $dim, shift $shift, $threads threads, trial $trial of $TRIALS" >&2
+                echo "# dim $dim, shift $shift, $threads threads, trial $trial" >>"$OUT.log"
+
+                if ! output=$(OMP_NUM_THREADS=$threads "$BINARY" "$dim" "$shift" --threads="$threads" \
+                                  "${OPTIONS[@]}" 2>/dev/null); then
+                    echo "Warning: run failed, left out" >&2
+                    echo "# failed" >>"$OUT.log"
+                    continue
+                fi
+                printf '%s\n\n' "$output" >>"$OUT.log"
+
+                printf '%s\n' "$output" | awk -v prefix="$MODE $base $dim $shift $threads" '
+                    /^Phase times:/ {
+                        sub(/^Phase times: /, "")
+                        n = split($0, phases, ", ")
+                        for (i = 1; i <= n; i++) {
+                            split(phases[i], field, " ")
+                            print prefix, field[1], field[2]
+                        }
+                    }
+                    /^Completed in/ { print prefix, "total", $3 + 0 }' >>"$RAW"
+            done
+        done
+    done
+done
+
+if [ ! -s "$RAW" ]; then
+    echo "Error: No run finished" >&2
+    exit 1
+fi
+
+# Median, fastest and slowest of each configuration, in the order they ran. Sorting puts the trials
+# of each configuration together, fastest first.
+sort -k2,2n -k4,4n -k5,5n -k6,6 -k7,7g "$RAW" | awk -v csv="$OUT.csv" -v json="$OUT.json" '
+    function flush() {
+        if (count == 0) return
+        median = (count % 2) ? times[(count + 1) / 2] : (times[count / 2] + times[count / 2 + 1]) / 2
+        keys[++configs] = key
+        line[key] = current
+        medians[key] = median
+        fastest[key] = times[1]
+        slowest[key] = times[count]
+        trials[key] = count
+        count = 0
+    }
+    {
+        k = $2 SUBSEP $4 SUBSEP $5 SUBSEP $6
+        if (count > 0 && k != key) flush()
+        key = k
+        current = $0
+        times[++count] = $7
+    }
+    END {
+        flush()
+        print "mode,base_dim,dim,shift,threads,phase,trials,median_s,min_s,max_s,speedup,efficiency" > csv
+        print "[" > json
+        for (c = 1; c <= configs; c++) {
+            key = keys[c]
+            split(line[key], f, " ")
+            mode = f[1]; base = f[2]; dim = f[3]; shift = f[4]; threads = f[5]; phase = f[6]
+
+            # Against the 1-thread median of the same configuration, if there is one and it timed
+            serial = base SUBSEP shift SUBSEP 1 SUBSEP phase
+            speedup = efficiency = "null"
+            if ((serial in medians) && medians[key] > 0) {
+                ratio = medians[serial] / medians[key]
+                speedup = (mode == "weak") ? ratio * threads : ratio
+                efficiency = speedup / threads
+                speedup = sprintf("%.4f", speedup)
+                efficiency = sprintf("%.4f", efficiency)
+            }
+
+            printf "%s,%d,%d,%d,%d,%s,%d,%.6f,%.6f,%.6f,%s,%s\n", mode, base, dim, shift, threads, phase,
+                   trials[key], medians[key], fastest[key], slowest[key],
+                   (speedup == "null") ? "" : speedup, (efficiency == "null") ? "" : efficiency > csv
+            printf "  {\"mode\": \"%s\", \"base_dim\": %d, \"dim\": %d, \"shift\": %d, \"threads\": %d, " \
+                   "\"phase\": \"%s\", \"trials\": %d, \"median_s\": %.6f, \"min_s\": %.6f, \"max_s\": %.6f, " \
+                   "\"speedup\": %s, \"efficiency\": %s}%s\n", mode, base, dim, shift, threads, phase,
+                   trials[key], medians[key], fastest[key], slowest[key], speedup, efficiency,
+                   (c < configs) ? "," : "" > json
+        }
+        print "]" > json
+    }'
+
+echo "Results in $OUT.csv and $OUT.json, output of every run in $OUT.log" >&2
+
+# Efficiency of the phases at the largest thread count, to see at a glance which stops scaling
+awk -F, -v most="${THREAD_LIST[${#THREAD_LIST[@]}-1]}" '
+    NR > 1 && $5 == most && $12 != "" {
+        printf "dim %d, shift %d, %d threads: %-8s %10.3f s, efficiency %.2f\n", $3, $4, $5, $6, $8, $12
+    }' "$OUT.csv"
+
+[ -z "$BASELINE" ] && exit 0
+
+# Same mode, dimension, shift, thread count and phase in both; the baseline is read first
+awk -F, -v tolerance="$TOLERANCE" -v floor="$FLOOR" '
+    FNR == 1 { next }
+    NR == FNR { baseline[$1 SUBSEP $3 SUBSEP $4 SUBSEP $5 SUBSEP $6] = $8; next }
+    {
+        key = $1 SUBSEP $3 SUBSEP $4 SUBSEP $5 SUBSEP $6
+        if (!(key in baseline)) next
+        compared++
+        was = baseline[key]
+        if ($8 > was * (1 + tolerance / 100) && $8 - was > floor) {
+            printf "Regression: dim %d, shift %d, %d threads, %s: %.3f s against %.3f s (%+.0f%%)\n",
+                   $3, $4, $5, $6, $8, was, (was > 0) ? 100 * ($8 - was) / was : 100
+            regressions++
+        }
+    }
+    END {
+        if (compared == 0) {
+            print "Warning: Nothing in common with the baseline" > "/dev/stderr"
+        } else {
+            printf "%d of %d compared against the baseline regressed\n", regressions, compared
+        }
+        exit regressions > 0 ? 2 : 0
+    }' "$BASELINE" "$OUT.csv"
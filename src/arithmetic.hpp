@@ -0,0 +1,184 @@
+/**
+ * @brief Choosing the cheapest arithmetic with enough precision for a run
+ *
+ * Small dimensions need nowhere near the precision of a 4096-bit fixedmpz, so the pipeline can run
+ * the same kernels over double-double, __float128 or quad-double instead. The floating types are
+ * tried cheapest first, each run checks the spread of its LDLt pivots to see how many bits were
+ * actually lost, and fixedmpz is only fallen back on once none of them has enough to spare.
+ *
+ * @file arithmetic.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include <gmpxx.h>
+
+#include "mpmatrix.hpp"
+#include "number_traits.hpp"
+
+namespace momentmp {
+    /**
+     * @brief Arithmetic the pipeline runs in, ordered from cheapest to most expensive
+     */
+    enum class Arithmetic { AUTO, DOUBLE_DOUBLE, FLOAT128, QUAD_DOUBLE, FIXED };
+
+    /**
+     * @brief Bits of the result that have to survive: a double's worth, as that is what is printed
+     */
+    const unsigned RESULT_BITS = 53;
+
+    /**
+     * @brief Whether <code>digits</code> bits of significand survive a factorization whose pivots
+     * spread over <code>lost</code> bits
+     *
+     * The error in the computed inverse came out at 1.6-1.7 times the pivot spread (in bits) for
+     * every type and dimension measured, so the spread is doubled to keep a little margin.
+     */
+    inline bool precision_covers(unsigned digits, double lost) {
+        return 2 * lost + RESULT_BITS <= digits;
+    }
+
+    inline const char *arithmetic_name(Arithmetic arithmetic) {
+        switch (arithmetic) {
+            case Arithmetic::DOUBLE_DOUBLE: return number_traits<double_double>::name;
+            case Arithmetic::QUAD_DOUBLE:   return number_traits<quad_double>::name;
+            case Arithmetic::FLOAT128:      return "__float128";
+            case Arithmetic::FIXED:         return number_traits<fixedmpz>::name;
+            default:                        return "auto";
+        }
+    }
+
+    /**
+     * @brief Parses auto, dd, f128, qd or fixed into an Arithmetic; returns false if unrecognized
+     */
+    inline bool parse_arithmetic(const std::string &name, Arithmetic &dest) {
+        if (name == "auto") {
+            dest = Arithmetic::AUTO;
+        } else if (name == "dd") {
+            dest = Arithmetic::DOUBLE_DOUBLE;
+        } else if (name == "f128" && has_float128) {
+            dest = Arithmetic::FLOAT128;
+        } else if (name == "qd") {
+            dest = Arithmetic::QUAD_DOUBLE;
+        } else if (name == "fixed") {
+            dest = Arithmetic::FIXED;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief A priori estimate of pivot_bits_lost() for the equilibrated moment matrix of a dimension
+     *
+     * The pivot spread grows linearly, at about 1.3 bits per dimension. Only used to skip types that
+     * are bound to fail; every run is still checked after the fact with pivot_bits_lost().
+     */
+    inline double estimated_bits_lost(size_t dim) {
+        return 1.3 * dim;
+    }
+
+    /**
+     * @brief Number of significand bits an Arithmetic carries (0 for fixedmpz, unbounded)
+     */
+    inline unsigned arithmetic_digits(Arithmetic arithmetic) {
+        switch (arithmetic) {
+            case Arithmetic::DOUBLE_DOUBLE: return number_traits<double_double>::digits;
+            case Arithmetic::QUAD_DOUBLE:   return number_traits<quad_double>::digits;
+            case Arithmetic::FLOAT128:      return 113;
+            default:                        return 0;
+        }
+    }
+
+    /**
+     * @brief The floating point types worth trying for a run, cheapest first
+     *
+     * An explicit choice is tried as is; AUTO gives every available type whose precision is expected
+     * to cover the dimension. An empty list (or every candidate failing) means fixedmpz.
+     */
+    inline std::vector<Arithmetic> arithmetic_candidates(Arithmetic choice, size_t dim) {
+        if (choice == Arithmetic::FIXED) {
+            return {};
+        }
+
+        if (choice != Arithmetic::AUTO) {
+            return {choice};
+        }
+
+        std::vector<Arithmetic> candidates;
+        for (auto type : {Arithmetic::DOUBLE_DOUBLE, Arithmetic::FLOAT128, Arithmetic::QUAD_DOUBLE}) {
+            if (type == Arithmetic::FLOAT128 && !has_float128) {
+                continue;
+            }
+
+            if (precision_covers(arithmetic_digits(type), estimated_bits_lost(dim))) {
+                candidates.push_back(type);
+            }
+        }
+        return candidates;
+    }
+
+    /**
+     * @brief Returns log2(max pivot / min pivot), the number of bits an LDLt factorization lost
+     *
+     * Infinite if any pivot is not positive, as then the factorization has gone entirely wrong.
+     */
+    template <typename T>
+    inline double pivot_bits_lost(const BasicMpArray<T> &diagonal) {
+        double lowest = std::numeric_limits<double>::infinity();
+        double highest = -lowest;
+
+        for (auto &pivot : diagonal) {
+            auto value = number_traits<T>::to_mpf(pivot);
+            if (sgn(value) <= 0) {
+                return std::numeric_limits<double>::infinity();
+            }
+
+            long exp;
+            double mantissa = mpf_get_d_2exp(&exp, value.get_mpf_t());
+            double bits = exp + std::log2(mantissa);
+
+            lowest = std::min(lowest, bits);
+            highest = std::max(highest, bits);
+        }
+
+        return diagonal.size() == 0 ? 0.0 : highest - lowest;
+    }
+
+    /**
+     * @brief Returns x * 2^exp as an mpf_class
+     */
+    template <typename T>
+    inline mpf_class scaled_mpf(const T &x, long exp) {
+        auto ret = number_traits<T>::to_mpf(x);
+        if (exp >= 0) {
+            mpf_mul_2exp(ret.get_mpf_t(), ret.get_mpf_t(), exp);
+        } else {
+            mpf_div_2exp(ret.get_mpf_t(), ret.get_mpf_t(), -exp);
+        }
+        return ret;
+    }
+
+    /**
+     * @brief Scales a block of M'^-1 back to M^-1 = S M'^-1 S and stores it in a fixedmpz matrix
+     */
+    template <typename T>
+    inline void to_fixed_block(const BasicMpMatrix<T> &block, const std::vector<long> &exponents,
+                               MpMatrix &dest) {
+        auto dim = std::min(block.getDim(), dest.getDim());
+        auto shift = dest.getShift();
+
+        for (size_t i = 0; i < dim; i++) {
+            for (size_t j = 0; j < dim; j++) {
+                auto value = scaled_mpf(block[i][j], exponents[i] + exponents[j] + long(shift));
+                mpz_set_f(dest[i][j].get_mpz_t(), value.get_mpf_t());
+            }
+        }
+    }
+}
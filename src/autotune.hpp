@@ -0,0 +1,368 @@
+/**
+ * @brief Picking the thread count, loop schedule and kernel variant by timing them
+ *
+ * Which settings run the factorization fastest depends on the dimension, the shift and the
+ * machine: how many bigint products each column update hands out against what a fork/join costs,
+ * whether GMP's multiplication on this build makes Kronecker substitution pay (see
+ * KroneckerPolicy), and whether all the hardware threads actually help. Rather than guess,
+ * autotune() times a short probe under each candidate, and the winners are kept in a profile file
+ * keyed by (CPU, dimension, shift), so later runs just load them.
+ *
+ * The hot kernel loops (the trailing updates of cholesky_decompose(), the row updates of invert()
+ * and trmm(), and their Kronecker tile loops) are declared schedule(runtime), so the schedule set
+ * by apply_tuning() reaches them without being passed around. With no profile,
+ * TuningConfig's defaults are the dynamic, 1 schedule these loops always had. None of the settings
+ * change any result: every entry is built up in the same order whichever thread computes it, and
+ * both kernel variants truncate every product the same way (up to the ulp mul_high() may be off
+ * by for operands below 2^-66).
+ *
+ * Profile layout: one tab-separated line per (CPU, dimension, shift), lines starting with '#' being
+ * comments:
+ *
+ *     <cpu>  <dim>  <shift>  <threads>  <static|dynamic|guided>  <chunk>  <element|kronecker>  <tile>
+ *
+ * @file autotune.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
+#include "fixedmpz.hpp"
+#include "kronecker.hpp"
+#include "moment_algorithm.hpp"
+#include "mpmatrix.hpp"
+#include "precision.hpp"
+
+namespace momentmp {
+    /**
+     * @brief One set of the settings the autotuner chooses between
+     */
+    struct TuningConfig {
+        int threads = 0;                        ///< 0 leaves the OpenMP default
+        omp_sched_t schedule = omp_sched_dynamic;
+        int chunk = 1;                          ///< chunk size of the schedule
+        KroneckerPolicy kronecker;              ///< kernel variant: element-wise unless enabled
+    };
+
+    /**
+     * @brief Sets the thread count and runtime schedule of a TuningConfig for the calling thread
+     *
+     * The kernel variant is not global state; pass config.kronecker on to the kernels.
+     */
+    inline void apply_tuning(const TuningConfig &config) {
+        if (config.threads > 0) {
+            omp_set_num_threads(config.threads);
+        }
+        omp_set_schedule(config.schedule, config.chunk);
+    }
+
+    /**
+     * @brief Short human readable form of a TuningConfig, e.g. "8 threads, dynamic,1, element-wise"
+     */
+    inline std::string describe(const TuningConfig &config) {
+        std::ostringstream out;
+        out << (config.threads > 0 ? config.threads : omp_get_max_threads()) << " threads, ";
+        switch (config.schedule) {
+            case omp_sched_static: out << "static"; break;
+            case omp_sched_guided: out << "guided"; break;
+            default:               out << "dynamic"; break;
+        }
+        out << "," << config.chunk << ", ";
+        if (config.kronecker.enabled) {
+            out << "Kronecker tiles of " << config.kronecker.tile;
+        } else {
+            out << "element-wise";
+        }
+        return out.str();
+    }
+
+    /**
+     * @brief Identifies the machine a profile entry was tuned on: CPU model and hardware threads
+     */
+    inline std::string cpu_signature() {
+        std::string model = "unknown";
+
+        std::ifstream cpuinfo("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(cpuinfo, line)) {
+            if (line.rfind("model name", 0) == 0 && line.find(':') != std::string::npos) {
+                model = line.substr(line.find_first_not_of(" \t", line.find(':') + 1));
+                break;
+            }
+        }
+
+        std::replace(model.begin(), model.end(), '\t', ' ');
+        return model + " x" + std::to_string(omp_get_num_procs());
+    }
+
+    /**
+     * @brief Tuned settings per (CPU, dimension, shift), loaded from and saved to a profile file
+     */
+    class TuningProfile {
+      private:
+        struct Entry {
+            std::string cpu;
+            size_t dim;
+            fmpz_shift_t shift;
+            TuningConfig config;
+        };
+
+        std::string path;
+        std::vector<Entry> entries;
+
+        static bool parse(const std::string &line, Entry &entry) {
+            std::vector<std::string> fields;
+            std::istringstream in(line);
+            for (std::string field; std::getline(in, field, '\t');) {
+                fields.push_back(field);
+            }
+            if (fields.size() != 8) {
+                return false;
+            }
+
+            entry.cpu = fields[0];
+            entry.dim = strtoul(fields[1].c_str(), NULL, 10);
+            entry.shift = strtoul(fields[2].c_str(), NULL, 10);
+            entry.config.threads = atoi(fields[3].c_str());
+            entry.config.chunk = std::max(atoi(fields[5].c_str()), 0);
+            entry.config.kronecker.enabled = (fields[6] == "kronecker");
+            entry.config.kronecker.tile = std::max<size_t>(strtoul(fields[7].c_str(), NULL, 10), 1);
+
+            if (fields[4] == "static") {
+                entry.config.schedule = omp_sched_static;
+            } else if (fields[4] == "dynamic") {
+                entry.config.schedule = omp_sched_dynamic;
+            } else if (fields[4] == "guided") {
+                entry.config.schedule = omp_sched_guided;
+            } else {
+                return false;
+            }
+
+            return entry.dim > 0 && entry.shift > 0 && entry.config.threads >= 0
+                   && (fields[6] == "kronecker" || fields[6] == "element");
+        }
+
+      public:
+        /**
+         * @brief Reads the profile at path; a missing file is an empty profile
+         *
+         * Malformed lines are skipped (and dropped on the next save()).
+         */
+        explicit TuningProfile(const std::string &path) : path(path) {
+            std::ifstream in(path);
+            std::string line;
+            while (std::getline(in, line)) {
+                Entry entry;
+                if (!line.empty() && line[0] != '#' && parse(line, entry)) {
+                    entries.push_back(entry);
+                }
+            }
+        }
+
+        /**
+         * @brief Default profile location: $HANKELHACKER_PROFILE, else ~/.hankelhacker-tuning
+         */
+        static std::string default_path() {
+            if (auto path = getenv("HANKELHACKER_PROFILE")) {
+                return path;
+            }
+            if (auto home = getenv("HOME")) {
+                return std::string(home) + "/.hankelhacker-tuning";
+            }
+            return ".hankelhacker-tuning";
+        }
+
+        const std::string &getPath() const {
+            return this->path;
+        }
+
+        /**
+         * @brief Settings for (cpu, dim, shift), or those tuned for the nearest problem on this CPU
+         *
+         * Nearest is by the sum of the log2 ratios of dimension and shift; nothing further than a
+         * factor of two away in total is used.
+         */
+        std::optional<TuningConfig> lookup(const std::string &cpu, size_t dim, fmpz_shift_t shift) const {
+            const Entry *best = nullptr;
+            double best_distance = 1.0;
+
+            for (auto &entry : entries) {
+                if (entry.cpu != cpu) {
+                    continue;
+                }
+
+                double distance = std::fabs(std::log2(double(entry.dim) / double(dim)))
+                                + std::fabs(std::log2(double(entry.shift) / double(shift)));
+                if (distance <= best_distance) {
+                    best = &entry;
+                    best_distance = distance;
+                }
+            }
+
+            if (!best) {
+                return std::nullopt;
+            }
+            return best->config;
+        }
+
+        /**
+         * @brief Adds or replaces the entry for (cpu, dim, shift)
+         */
+        void record(const std::string &cpu, size_t dim, fmpz_shift_t shift, const TuningConfig &config) {
+            entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const Entry &entry) {
+                return entry.cpu == cpu && entry.dim == dim && entry.shift == shift;
+            }), entries.end());
+            entries.push_back(Entry{cpu, dim, shift, config});
+        }
+
+        /**
+         * @brief Writes the whole profile back out, replacing the file in one rename
+         */
+        void save() const {
+            const std::string temporary = path + ".tmp";
+            {
+                std::ofstream out(temporary, std::ios::trunc);
+                if (!out) {
+                    throw std::runtime_error("Cannot open " + temporary + " for writing");
+                }
+
+                out << "# cpu\tdim\tshift\tthreads\tschedule\tchunk\tkernel\ttile\n";
+                for (auto &entry : entries) {
+                    const auto &config = entry.config;
+                    out << entry.cpu << '\t' << entry.dim << '\t' << entry.shift << '\t'
+                        << config.threads << '\t'
+                        << (config.schedule == omp_sched_static ? "static"
+                            : config.schedule == omp_sched_guided ? "guided" : "dynamic") << '\t'
+                        << config.chunk << '\t'
+                        << (config.kronecker.enabled ? "kronecker" : "element") << '\t'
+                        << config.kronecker.tile << '\n';
+                }
+
+                if (!out) {
+                    throw std::runtime_error("Failed writing " + temporary);
+                }
+            }
+
+            if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+                throw std::runtime_error("Cannot replace " + path);
+            }
+        }
+    };
+
+    namespace autotune_detail {
+        /**
+         * @brief Seconds the first steps columns of the factorization of m take under config
+         *
+         * Best of two runs, each on a fresh copy (the copying not being timed).
+         */
+        inline double probe(const MpMatrix &m, size_t steps, const TuningConfig &config) {
+            apply_tuning(config);
+
+            double best = 0;
+            for (int run = 0; run < 2; run++) {
+                MpMatrix copy(m);
+
+                auto start = std::chrono::steady_clock::now();
+                cholesky_decompose(copy, config.kronecker, PrecisionGuard{false}, steps);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+                if (run == 0 || elapsed.count() < best) {
+                    best = elapsed.count();
+                }
+            }
+            return best;
+        }
+
+        /**
+         * @brief Keeps whichever candidate probes fastest in best (and its time in best_time)
+         */
+        template <typename Vary>
+        inline void descend(const MpMatrix &m, size_t steps, TuningConfig &best, double &best_time,
+                            size_t candidates, Vary vary) {
+            for (size_t c = 0; c < candidates; c++) {
+                TuningConfig candidate = best;
+                if (!vary(candidate, c)) {
+                    continue;
+                }
+
+                auto time = probe(m, steps, candidate);
+                if (time < best_time) {
+                    best = candidate;
+                    best_time = time;
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Times the candidate settings on a dim x dim moment matrix and returns the fastest
+     *
+     * The probe is the first few columns of the actual factorization (the most expensive ones,
+     * with the full trailing matrix still to update), as many as take about budget seconds under
+     * the default settings. The settings are then tuned one at a time, each keeping the best of
+     * the ones before: the thread count (all hardware threads, then halving, down to 1), the
+     * schedule (dynamic and guided with a few chunk sizes, and static), and the kernel variant
+     * (element-wise, or Kronecker substitution with a few tile sizes).
+     *
+     * Leaves the thread count and schedule of the calling thread as they were.
+     */
+    inline TuningConfig autotune(size_t dim, fmpz_shift_t shift, double budget = 0.25) {
+        const int threads = omp_get_max_threads();
+        int sched_chunk;
+        omp_sched_t sched_kind;
+        omp_get_schedule(&sched_kind, &sched_chunk);
+
+        MpMatrix m(dim, shift, COL_ORIENTED);
+        momentInit(m);
+
+        TuningConfig best;
+        best.threads = omp_get_num_procs();
+
+        // Calibrate how many columns fill the budget from the first one
+        size_t steps = 1;
+        double best_time = autotune_detail::probe(m, steps, best);
+        if (best_time > 0 && best_time < budget) {
+            steps = std::min<size_t>(dim, size_t(std::ceil(budget / best_time)));
+            best_time = autotune_detail::probe(m, steps, best);
+        }
+
+        autotune_detail::descend(m, steps, best, best_time, 4, [&](TuningConfig &config, size_t c) {
+            config.threads = omp_get_num_procs() >> (c + 1);
+            return config.threads >= 1;
+        });
+
+        const std::pair<omp_sched_t, int> schedules[] = {
+            {omp_sched_dynamic, 4}, {omp_sched_dynamic, 16}, {omp_sched_guided, 1}, {omp_sched_static, 0}};
+        autotune_detail::descend(m, steps, best, best_time, 4, [&](TuningConfig &config, size_t c) {
+            std::tie(config.schedule, config.chunk) = schedules[c];
+            return true;
+        });
+
+        const size_t tiles[] = {8, 16, 32};
+        autotune_detail::descend(m, steps, best, best_time, 3, [&](TuningConfig &config, size_t c) {
+            config.kronecker.enabled = true;
+            config.kronecker.tile = tiles[c];
+            return true;
+        });
+
+        omp_set_num_threads(threads);
+        omp_set_schedule(sched_kind, sched_chunk);
+        return best;
+    }
+}
@@ -77,15 +77,10 @@ void demo_multiply(MpMatrix &m, size_t dim, fmpz_shift_t m_shift) {
     std::cout << "lt:\n" << lt << std::endl;
     std::cout << "diagonal: " << diagonal << std::endl;
 
-    MpMatrix d(dim, m_shift, ROW_ORIENTED);
-    impose_diagonal(diagonal, d);
-    std::cout << "ld:\n" << l << std::endl;
-
-    MpMatrix ld(dim, m_shift, ROW_ORIENTED);
-    multiply(l, d, ld);
-
-    MpMatrix ldlt(dim, m_shift, ROW_ORIENTED);
-    multiply(ld, lt, ldlt);
+    // L D Lt, as D Lt (upper triangular) multiplied by L from the left
+    MpMatrix ldlt(lt);
+    scale_rows(diagonal, ldlt, Structure::UPPER);
+    trmm(l, ldlt, Structure::UPPER);
 
     std::cout << "ldlt:\n" << ldlt << std::endl;
 }
\ No newline at end of file
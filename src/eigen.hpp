@@ -7,60 +7,375 @@
 
 #pragma once
 
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <new>
+#include <stdexcept>
 #include <vector>
 
+#include <gmpxx.h>
+#include <omp.h>
 #include <gsl/gsl_math.h>
 #include <gsl/gsl_eigen.h>
 
+#include "fixedmpz.hpp"
+#include "moment_algorithm.hpp"
 #include "mpmatrix.hpp"
 
 namespace momentmp {
 
+    /**
+     * @brief For this project, we would only be interested in the largest/smallest eigenvalue
+     */
+    enum EigenMode : bool { SMALLEST=true, LARGEST=false };
+
+    /**
+     * @brief The GSL symmetric eigensolver, with its workspace kept from one call to the next
+     *
+     * Sweeps and batches solve thousands of blocks of the same size, so the workspace, the vector
+     * of eigenvalues and the double copy of the matrix are only reallocated when the size changes.
+     * The matrix is brought down to doubles scaled by a power of 2 that puts its largest entry near
+     * 1, and the eigenvalues scaled back up, so that an inverse block beyond the range of a double
+     * still has its eigenvalues found (as long as they themselves are within it).
+     */
+    class EigenSolver {
+      private:
+        size_t dim = 0;
+        std::vector<double> m;
+        gsl_vector *eval = nullptr;
+        gsl_eigen_symm_workspace *workspace = nullptr;
+
+        void release() {
+            if (eval) gsl_vector_free(eval);
+            if (workspace) gsl_eigen_symm_free(workspace);
+            eval = nullptr;
+            workspace = nullptr;
+            dim = 0;
+        }
+
+        void resize(size_t dim) {
+            if (dim == this->dim) {
+                return;
+            }
+
+            release();
+            eval = gsl_vector_alloc(dim);
+            workspace = gsl_eigen_symm_alloc(dim);
+            if (!eval || !workspace) {
+                release();
+                throw std::bad_alloc();
+            }
+            m.resize(dim * dim);
+            this->dim = dim;
+        }
+
+      public:
+        EigenSolver() = default;
+        EigenSolver(const EigenSolver &) = delete;
+        EigenSolver &operator=(const EigenSolver &) = delete;
+
+        ~EigenSolver() {
+            release();
+        }
+
+        /**
+         * @brief Fills eigenvalues (which must hold getDim() of them) with those of matrix
+         */
+        void solve(const MpMatrix &matrix, std::vector<double> &eigenvalues) {
+            auto dim = matrix.getDim();
+            auto shift = long(matrix.getShift());
+            resize(dim);
+
+            long scale = LONG_MIN;
+            for (const auto &line : matrix) {
+                for (const auto &entry : line) {
+                    if (sgn(entry()) != 0) {
+                        scale = std::max(scale, long(mpz_sizeinbase(entry.get_mpz_t(), 2)) - shift);
+                    }
+                }
+            }
+            if (scale == LONG_MIN) {
+                scale = 0;
+            }
+            matrix.dumpVecDouble(m, scale);
+
+            gsl_matrix_view gsl_m = gsl_matrix_view_array(&m[0], dim, dim);
+            gsl_eigen_symm(&gsl_m.matrix, eval, workspace);
+
+            for (size_t index = 0; index < dim; index++) {
+                eigenvalues[index] = std::ldexp(gsl_vector_get(eval, index), int(scale));
+            }
+        }
+
+        /**
+         * @brief Returns either the smallest or the largest eigenvalue of matrix
+         */
+        double get(const MpMatrix &matrix, const EigenMode mode) {
+            std::vector<double> eigenvalues(matrix.getDim());
+            solve(matrix, eigenvalues);
+
+            if (mode == SMALLEST) {
+                return *(std::min_element(eigenvalues.begin(), eigenvalues.end()));
+            } else if (mode == LARGEST) {
+                return *(std::max_element(eigenvalues.begin(), eigenvalues.end()));
+            }
+
+            // Hopefully this never happens
+            throw std::runtime_error("Desired output neither SMALLEST nor LARGEST");
+        }
+    };
+
+    namespace eigen_detail {
+        /// The calling thread's own EigenSolver
+        inline EigenSolver &thread_solver() {
+            thread_local EigenSolver solver;
+            return solver;
+        }
+    }
+
     /**
      * @brief Take in an MpMatrix and return an std::vector of its eigenvalues
      *
-     * First the MpMatrix is brought down to just double-precision, and then it is handed off to
-     * the GSL eigensolver for it to do its magic.
+     * Goes through an EigenSolver kept by the calling thread, so repeated calls (concurrent ones
+     * included) reuse its workspace.
      */
     inline void eigen_solve(const MpMatrix &matrix, std::vector<double> &eigenvalues) {
-        auto dim = matrix.getDim();
-        std::vector<double> m(dim * dim);
-        matrix.dumpVecDouble(m);
+        eigen_detail::thread_solver().solve(matrix, eigenvalues);
+    }
 
-        gsl_vector *eval = gsl_vector_alloc(dim);
-        gsl_eigen_symm_workspace *workspace = gsl_eigen_symm_alloc(dim);
-        gsl_matrix_view gsl_m;
+    /**
+     * @brief Calls eigen_solve, but then returns either the smallest/largest eigenvalue it finds
+     */
+    inline double get_eigenvalue(const MpMatrix &matrix, const EigenMode mode) {
+        return eigen_detail::thread_solver().get(matrix, mode);
+    }
+
+    /**
+     * @brief Solves (LDLt)x = b in place, for L with D superimposed as cholesky_decompose() leaves it
+     *
+     * ldlt must still be column-oriented. Forward substitution sweeps down the columns of L, the
+     * back substitution with Lt sweeps up its rows; either way each step updates every remaining
+     * entry of x independently, so those updates are spread across threads. O(n^2) in all.
+     */
+    inline void ldlt_solve(const MpMatrix &ldlt, MpArray &x) {
+        auto dim = ldlt.getDim();
+
+        if (ldlt.getMode() != COL_ORIENTED) {
+            throw std::invalid_argument("ldlt_solve needs a column-oriented LDLt factor");
+        }
 
-        gsl_m = gsl_matrix_view_array(&m[0], dim, dim);
-        gsl_eigen_symm(&gsl_m.matrix, eval, workspace);
-        gsl_eigen_symm_free(workspace);
+        // Lz = b
+        for (size_t col = 0; col < dim; col++) {
+            const auto &pivot = x[col];
+
+            #pragma omp parallel for schedule(static)
+            for (size_t row = col + 1; row < dim; row++) {
+                x[row] -= ldlt[col][row] * pivot;
+            }
+        }
 
+        // Dw = z
+        #pragma omp parallel for schedule(static)
         for (size_t index = 0; index < dim; index++) {
-            eigenvalues[index] = gsl_vector_get(eval, index);
+            x[index] /= ldlt[index][index];
+        }
+
+        // Lt x = w, where Lt[k][row] = L[row][k] is found in column k
+        for (size_t row = dim; row-- > 0;) {
+            const auto &pivot = x[row];
+
+            #pragma omp parallel for schedule(static)
+            for (size_t k = 0; k < row; k++) {
+                x[k] -= ldlt[k][row] * pivot;
+            }
         }
     }
 
     /**
-     * @brief For this project, we would only be interested in the largest/smallest eigenvalue
+     * @brief An eigenvalue along with a bound on how far from it the true eigenvalue can be
      */
-    enum EigenMode : bool { SMALLEST=true, LARGEST=false };
+    struct EigenEstimate {
+        mpf_class value;    ///< Rayleigh quotient of the final iterate
+        double bound;       ///< some eigenvalue of the matrix lies within value +- bound
+        size_t iterations;  ///< number of solves it took
+        bool converged;     ///< whether bound came in under the requested tolerance
+    };
 
     /**
-     * @brief Calls eigen_solve, but then returns either the smallest/largest eigenvalue it finds
+     * @brief Finds the smallest eigenvalue of M by inverse iteration on its LDLt factorization
+     *
+     * Each iteration solves My = x through ldlt_solve() (so L never has to be inverted), and takes
+     * the Rayleigh quotient rho = x.y / y.y of y. The residual r = My - rho y = x - rho y comes for
+     * free, and by Weinstein's bound some eigenvalue of M lies within |r| / |y| of rho. Inverse
+     * iteration from e_0 converges to the eigenvalue nearest zero, i.e. the smallest one of a
+     * positive definite M, with the bound shrinking by about lambda_1 / lambda_2 per iteration.
+     *
+     * @param ldlt output of cholesky_decompose() on M (L with D superimposed, column-oriented)
+     * @param tolerance stop once the bound is at most tolerance times the eigenvalue
      */
-    inline double get_eigenvalue(const MpMatrix &matrix, const EigenMode mode) {
-        auto dim = matrix.getDim();
-        std::vector<double> eigenvalues(dim);
+    inline EigenEstimate smallest_eigenvalue(const MpMatrix &ldlt, double tolerance = 1e-20,
+                                             size_t max_iterations = 1000) {
+        auto dim = ldlt.getDim();
+        auto shift = ldlt.getShift();
+
+        auto dot = [&](const MpArray &a, const MpArray &b) {
+            fixedmpz sum(0, shift);
+            for (size_t index = 0; index < dim; index++) {
+                sum += a[index] * b[index];
+            }
+            return sum.to_mpf();
+        };
+
+        MpArray x(dim, shift);
+        x[0] = 1^fmpzshift(shift);
+
+        EigenEstimate estimate{mpf_class(0, shift), INFINITY, 0, false};
+        while (estimate.iterations < max_iterations && !estimate.converged) {
+            MpArray y(x);
+            ldlt_solve(ldlt, y);
+            estimate.iterations++;
+
+            mpf_class yy = dot(y, y);
+            mpf_class rho = dot(x, y) / yy;
+            mpf_class norm = sqrt(yy);
+
+            // |x - rho y|^2, and x <- y / |y| for the next round
+            mpf_class residual(0, shift), entry(0, shift);
+            for (size_t index = 0; index < dim; index++) {
+                entry = x[index].to_mpf() - rho * y[index].to_mpf();
+                residual += entry * entry;
+
+                entry = y[index].to_mpf() / norm;
+                mpf_mul_2exp(entry.get_mpf_t(), entry.get_mpf_t(), shift);
+                x[index] = fixedmpz(mpz_class(entry), shift);
+            }
+
+            estimate.value = rho;
+            estimate.bound = mpf_class(sqrt(residual) / norm).get_d();
+            estimate.converged = estimate.bound <= tolerance * rho.get_d();
+        }
+
+        return estimate;
+    }
+
+    /**
+     * @brief Counts the eigenvalues of a symmetric M that lie below sigma
+     *
+     * By Sylvester's law of inertia, M - sigma I has as many negative eigenvalues as the D of its
+     * LDLt factorization has negative entries, so this just factors a copy of M shifted by sigma
+     * and counts negative pivots. Should sigma hit an eigenvalue closely enough to produce an
+     * exactly zero pivot, it is nudged up by one ulp and the factorization redone.
+     *
+     * The copy never takes on m's ownership map: this runs on a thread of bracket_eigenvalue()'s
+     * team, so the factorization has to stay on the calling thread, which is also what lets the
+     * zero pivot's domain_error be caught here rather than escape a parallel region.
+     *
+     * @param m lower triangle of M, column-oriented (as momentInit() leaves it)
+     */
+    inline size_t eigenvalues_below(const MpMatrix &m, fixedmpz sigma) {
+        auto dim = m.getDim();
+
+        while (true) {
+            MpMatrix shifted(dim, m.getShift(), m.getMode());
+            for (size_t index = 0; index < dim; index++) {
+                shifted[index] = m[index];
+            }
+            for (size_t index = 0; index < dim; index++) {
+                shifted[index][index] -= sigma;
+            }
+
+            // Pivots of a shifted matrix are meant to go small and negative, so no precision guard
+            try {
+                cholesky_decompose(shifted, KroneckerPolicy(), PrecisionGuard{false});
+            } catch (const std::domain_error &) {
+                sigma() += 1;
+                continue;
+            }
+
+            size_t negative = 0;
+            for (size_t index = 0; index < dim; index++) {
+                negative += sgn(shifted[index][index]()) < 0;
+            }
+            return negative;
+        }
+    }
+
+    /**
+     * @brief An interval certified to contain an eigenvalue
+     */
+    struct EigenBracket {
+        mpf_class lower;        ///< the eigenvalue is at least this
+        mpf_class upper;        ///< and less than this
+        size_t factorizations;  ///< number of shifted LDLt factorizations it took
+    };
+
+    /**
+     * @brief Narrows [lower, upper) down around the index-th smallest eigenvalue of M by
+     * multisection on inertia counts
+     *
+     * Every round places one shift per thread evenly across the bracket and factors them all at
+     * once (see eigenvalues_below()), then keeps the subinterval where the count steps past
+     * index. With p threads, a round shrinks the bracket by a factor of p + 1. Stops as soon as
+     * the bracket is within 10^-digits of its upper end, or can't be split any further at the
+     * matrix's shift.
+     *
+     * The counts are only as good as the signs of the computed pivots, so they are exact as long
+     * as the rounding of the fixed-point factorization stays below the smallest pivot in
+     * magnitude; unlike the eigensolver this never depends on a double-precision copy of M.
+     *
+     * @param index 0 for the smallest eigenvalue, getDim() - 1 for the largest
+     * @param lower,upper initial bracket: at most index eigenvalues below lower, more below upper
+     */
+    inline EigenBracket bracket_eigenvalue(const MpMatrix &m, size_t index, const mpf_class &lower,
+                                           const mpf_class &upper, double digits) {
+        auto shift = m.getShift();
+        const mp_bitcnt_t precision = shift + 64;
+
+        // Shifts are picked as fixedmpz so that the bracket ends are exactly the shifts factored
+        auto to_fixed = [&](const mpf_class &x) {
+            mpf_class scaled(x, precision);
+            mpf_mul_2exp(scaled.get_mpf_t(), scaled.get_mpf_t(), shift);
+            return fixedmpz(mpz_class(scaled), shift);
+        };
+        auto to_mpf = [&](const fixedmpz &x) {
+            mpf_class value(0, precision);
+            mpf_set_z(value.get_mpf_t(), x.get_mpz_t());
+            mpf_div_2exp(value.get_mpf_t(), value.get_mpf_t(), shift);
+            return value;
+        };
+
+        EigenBracket bracket{mpf_class(lower, precision), mpf_class(upper, precision), 0};
+        const mpf_class tolerance(std::pow(10.0, -digits));
+        const size_t sections = std::max(omp_get_max_threads(), 1) + 1;
+        mpf_class ulp(1, precision);
+        mpf_div_2exp(ulp.get_mpf_t(), ulp.get_mpf_t(), shift);
+
+        std::vector<fixedmpz> sigmas(sections - 1, fixedmpz(0, shift));
+        std::vector<size_t> counts(sections - 1);
+
+        while (bracket.upper - bracket.lower > tolerance * abs(bracket.upper)
+               && bracket.upper - bracket.lower > sections * ulp) {
+            for (size_t s = 1; s < sections; s++) {
+                sigmas[s - 1] = to_fixed(bracket.lower + (bracket.upper - bracket.lower) * s / sections);
+            }
 
-        eigen_solve(matrix, eigenvalues);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (size_t s = 0; s < sigmas.size(); s++) {
+                counts[s] = eigenvalues_below(m, sigmas[s]);
+            }
+            bracket.factorizations += sigmas.size();
 
-        if (mode == SMALLEST) {
-            return *(std::min_element(eigenvalues.begin(), eigenvalues.end()));
-        } else if (mode == LARGEST) {
-            return *(std::max_element(eigenvalues.begin(), eigenvalues.end()));
+            // counts never decrease with sigma, so the first one past index ends the bracket
+            for (size_t s = 0; s < sigmas.size(); s++) {
+                if (counts[s] > index) {
+                    bracket.upper = to_mpf(sigmas[s]);
+                    break;
+                }
+                bracket.lower = to_mpf(sigmas[s]);
+            }
         }
 
-        // Hopefully this never happens
-        throw std::runtime_error("Desired output neither SMALLEST nor LARGEST");
+        return bracket;
     }
 }
@@ -0,0 +1,284 @@
+/**
+ * @brief Bulk export of MpMatrix/MpArray contents at full precision
+ *
+ * The stream operators go through to_mpf() one element at a time, which is both slow and lossy.
+ * The exporters here write every element exactly, either as raw limbs or as exact decimal/hex
+ * text. Threads each format a disjoint range of columns straight into a buffer allocated up front,
+ * and the whole file then goes out in a single write.
+ *
+ * Binary layout (native endianness), all integers unsigned unless noted:
+ *
+ *     char[4]  magic "MPMX"
+ *     u32      version (1)
+ *     u32      bits per limb
+ *     u32      layout: 0 column-oriented matrix, 1 row-oriented matrix, 2 array
+ *     u64      number of columns (storage vectors); 1 for an array
+ *     u64      elements per column
+ *     u64      shift
+ *
+ * followed by every element in storage order, each as an i64 limb count (negative for negative
+ * numbers, as in mpz_t) and then that many limbs, least significant first. An element's value is
+ * its integer divided by 2^shift.
+ *
+ * Text layout: a "# " header line giving the same fields, then one line per storage column with
+ * its elements separated by tabs. Decimal text is the exact value (a number of the form k / 2^shift
+ * always has a terminating decimal expansion); hex text is the C99 hex-float form
+ * [-]0x<integer>p-<shift>, which is exact as well and much cheaper to produce.
+ *
+ * @file export.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <gmpxx.h>
+#include <omp.h>
+
+#include "fixedmpz.hpp"
+#include "mpmatrix.hpp"
+
+namespace momentmp {
+    /**
+     * @brief Format of an exported file
+     */
+    enum class ExportFormat { BINARY, DECIMAL, HEX };
+
+    namespace export_detail {
+        const char MAGIC[4] = {'M', 'P', 'M', 'X'};
+        const uint32_t VERSION = 1;
+        const uint32_t LAYOUT_COL = 0, LAYOUT_ROW = 1, LAYOUT_ARRAY = 2;
+
+        /**
+         * @brief The elements to export, as columns of equal length, whether matrix or array
+         */
+        struct Columns {
+            uint32_t layout;
+            size_t count;
+            size_t length;
+            fmpz_shift_t shift;
+            std::vector<const MpArray *> columns;
+        };
+
+        inline Columns columns_of(const MpMatrix &matrix) {
+            Columns ret{matrix.getMode() == ROW_ORIENTED ? LAYOUT_ROW : LAYOUT_COL, matrix.getDim(),
+                        matrix.getDim(), matrix.getShift(), {}};
+            for (auto &column : matrix) {
+                ret.columns.push_back(&column);
+            }
+            return ret;
+        }
+
+        inline Columns columns_of(const MpArray &array) {
+            return Columns{LAYOUT_ARRAY, 1, array.size(), array.getShift(), {&array}};
+        }
+
+        inline void write_file(const std::string &path, const char *data, size_t size) {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            if (!out) {
+                throw std::runtime_error("Cannot open " + path + " for writing");
+            }
+
+            out.write(data, size);
+            if (!out) {
+                throw std::runtime_error("Failed writing " + path);
+            }
+        }
+
+        /// Bytes a binary element record takes
+        inline size_t record_size(const fixedmpz &x) {
+            return sizeof(int64_t) + mpz_size(x.get_mpz_t()) * sizeof(mp_limb_t);
+        }
+
+        inline void write_binary(const std::string &path, const Columns &cols) {
+            const size_t header = sizeof(MAGIC) + 3 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+
+            // Sizes of every column first, so every thread knows where its columns start
+            std::vector<size_t> offsets(cols.count + 1, 0);
+            #pragma omp parallel for schedule(dynamic, 16)
+            for (size_t c = 0; c < cols.count; c++) {
+                size_t size = 0;
+                for (auto &x : *cols.columns[c]) {
+                    size += record_size(x);
+                }
+                offsets[c + 1] = size;
+            }
+            offsets[0] = header;
+            for (size_t c = 0; c < cols.count; c++) {
+                offsets[c + 1] += offsets[c];
+            }
+
+            std::vector<char> buffer(offsets[cols.count]);
+            char *out = buffer.data();
+
+            const uint32_t fields[3] = {VERSION, GMP_NUMB_BITS, cols.layout};
+            const uint64_t sizes[3] = {cols.count, cols.length, cols.shift};
+            std::memcpy(out, MAGIC, sizeof(MAGIC));
+            std::memcpy(out + sizeof(MAGIC), fields, sizeof(fields));
+            std::memcpy(out + sizeof(MAGIC) + sizeof(fields), sizes, sizeof(sizes));
+
+            #pragma omp parallel for schedule(dynamic, 16)
+            for (size_t c = 0; c < cols.count; c++) {
+                char *at = out + offsets[c];
+                for (auto &x : *cols.columns[c]) {
+                    const int64_t limbs = x.get_mpz_t()->_mp_size;
+                    const size_t bytes = mpz_size(x.get_mpz_t()) * sizeof(mp_limb_t);
+
+                    std::memcpy(at, &limbs, sizeof(limbs));
+                    std::memcpy(at + sizeof(limbs), mpz_limbs_read(x.get_mpz_t()), bytes);
+                    at += sizeof(limbs) + bytes;
+                }
+            }
+
+            write_file(path, buffer.data(), buffer.size());
+        }
+
+        /**
+         * @brief Appends the exact value of x as text in the given format
+         *
+         * @param five_pow 5^shift, shared by every element of the export (decimal only)
+         */
+        inline void format(std::string &out, const fixedmpz &x, ExportFormat format,
+                           const mpz_class &five_pow) {
+            const auto shift = x.getShift();
+            mpz_class magnitude = abs(x());
+
+            if (sgn(x()) < 0) {
+                out += '-';
+            }
+
+            if (format == ExportFormat::HEX) {
+                out += "0x";
+                out += magnitude.get_str(16);
+                out += "p-";
+                out += std::to_string(shift);
+                return;
+            }
+
+            // integer part, then the fraction r / 2^shift = r * 5^shift / 10^shift
+            mpz_class whole, fraction;
+            mpz_tdiv_q_2exp(whole.get_mpz_t(), magnitude.get_mpz_t(), shift);
+            mpz_tdiv_r_2exp(fraction.get_mpz_t(), magnitude.get_mpz_t(), shift);
+            out += whole.get_str(10);
+
+            if (fraction != 0) {
+                fraction *= five_pow;
+                auto digits = fraction.get_str(10);
+                digits.insert(0, shift - digits.size(), '0');
+                digits.erase(digits.find_last_not_of('0') + 1);
+
+                out += '.';
+                out += digits;
+            }
+        }
+
+        inline void write_text(const std::string &path, const Columns &cols, ExportFormat format) {
+            mpz_class five_pow;
+            if (format == ExportFormat::DECIMAL) {
+                mpz_ui_pow_ui(five_pow.get_mpz_t(), 5, cols.shift);
+            }
+
+            std::string header = "# layout=";
+            header += (cols.layout == LAYOUT_ARRAY) ? "array" : (cols.layout == LAYOUT_ROW) ? "row" : "col";
+            header += " columns=" + std::to_string(cols.count);
+            header += " length=" + std::to_string(cols.length);
+            header += " shift=" + std::to_string(cols.shift);
+            header += (format == ExportFormat::HEX) ? " format=hex\n" : " format=decimal\n";
+
+            // Every column is formatted by one thread into its own preallocated buffer
+            std::vector<std::string> lines(cols.count);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (size_t c = 0; c < cols.count; c++) {
+                auto &line = lines[c];
+
+                size_t estimate = 0;
+                for (auto &x : *cols.columns[c]) {
+                    auto bits = mpz_sizeinbase(x.get_mpz_t(), 2);
+                    estimate += (format == ExportFormat::HEX) ? bits / 4 + 32 : bits / 3 + cols.shift + 8;
+                }
+                line.reserve(estimate);
+
+                for (auto &x : *cols.columns[c]) {
+                    if (!line.empty()) {
+                        line += '\t';
+                    }
+                    export_detail::format(line, x, format, five_pow);
+                }
+                line += '\n';
+            }
+
+            std::vector<size_t> offsets(cols.count + 1, header.size());
+            for (size_t c = 0; c < cols.count; c++) {
+                offsets[c + 1] = offsets[c] + lines[c].size();
+            }
+
+            std::vector<char> buffer(offsets[cols.count]);
+            std::memcpy(buffer.data(), header.data(), header.size());
+
+            #pragma omp parallel for schedule(dynamic, 16)
+            for (size_t c = 0; c < cols.count; c++) {
+                std::memcpy(buffer.data() + offsets[c], lines[c].data(), lines[c].size());
+                std::string().swap(lines[c]);
+            }
+
+            write_file(path, buffer.data(), buffer.size());
+        }
+
+        inline void write(const std::string &path, const Columns &cols, ExportFormat format) {
+            if (format == ExportFormat::BINARY) {
+                write_binary(path, cols);
+            } else {
+                write_text(path, cols, format);
+            }
+        }
+    }
+
+    /**
+     * @brief Writes every element of a matrix at full precision (see export.hpp for the layouts)
+     */
+    inline void export_matrix(const MpMatrix &matrix, const std::string &path,
+                              ExportFormat format = ExportFormat::BINARY) {
+        export_detail::write(path, export_detail::columns_of(matrix), format);
+    }
+
+    /**
+     * @brief Writes every element of an array at full precision (see export.hpp for the layouts)
+     */
+    inline void export_array(const MpArray &array, const std::string &path,
+                             ExportFormat format = ExportFormat::BINARY) {
+        export_detail::write(path, export_detail::columns_of(array), format);
+    }
+
+    /**
+     * @brief Parses bin, dec or hex into an ExportFormat; returns false if unrecognized
+     */
+    inline bool parse_export_format(const std::string &name, ExportFormat &dest) {
+        if (name == "bin") {
+            dest = ExportFormat::BINARY;
+        } else if (name == "dec") {
+            dest = ExportFormat::DECIMAL;
+        } else if (name == "hex") {
+            dest = ExportFormat::HEX;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief File extension conventionally used for a format
+     */
+    inline const char *export_extension(ExportFormat format) {
+        switch (format) {
+            case ExportFormat::DECIMAL: return ".dec";
+            case ExportFormat::HEX:     return ".hex";
+            default:                    return ".mpmx";
+        }
+    }
+}
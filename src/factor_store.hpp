@@ -0,0 +1,517 @@
+/**
+ * @brief An on-disk store of completed LDLt factors, extended rather than redone by larger runs
+ *
+ * Step k of cholesky_decompose() only ever reads column k and the rows below it, so the leading
+ * n x n block of the factor of M is the factor of M's own leading n x n block: it doesn't depend on
+ * the dimension being run. A store keeps the rows of the factor a run produced, and a later run of
+ * the same moment sequence at the same shift only has to eliminate its new rows against them
+ * (extend_factor()), instead of factoring everything again.
+ *
+ * One file per (moment sequence, shift) (see FactorStore::path_for()). Layout, native endianness:
+ *
+ *     char[4]  magic "MPFS"
+ *     u32      version (1)
+ *     u32      bits per limb
+ *     u64      shift
+ *     u64      number of rows stored
+ *
+ * followed by row i = 0, 1, ... as a u64 hash of the moments mu_0 ... mu_2i the row depends on,
+ * then C[i][0], ..., C[i][i], each as an element record of export.hpp (an i64 signed limb count and
+ * that many limbs). C = LD is the factor as it is before each column is divided by its pivot (so
+ * C[i][i] = d_i): L is easily had back from it, but not the other way around, and extending the
+ * factor needs C exactly. Rows are only ever appended, and the row count in the header is updated
+ * after the rows themselves are written, so an interrupted append leaves the store as it was. The
+ * hashes catch a store that was built from a different sequence.
+ *
+ * @file factor_store.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <gmpxx.h>
+#include <omp.h>
+#include <sys/stat.h>
+
+#include "export.hpp"
+#include "fixedmpz.hpp"
+#include "ingest.hpp"
+#include "kronecker.hpp"
+#include "moment_algorithm.hpp"
+#include "mpmatrix.hpp"
+#include "precision.hpp"
+
+namespace momentmp {
+    namespace factor_store_detail {
+        const char MAGIC[4] = {'M', 'P', 'F', 'S'};
+        const uint32_t VERSION = 1;
+        const size_t HEADER = sizeof(MAGIC) + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+        const size_t ROWS_FIELD = HEADER - sizeof(uint64_t);
+        const size_t BLOCK = size_t(1) << 20;   ///< bytes of rows load() and append() go through at once
+
+        const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+        const uint64_t FNV_PRIME = 1099511628211ULL;
+
+        inline uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+            auto bytes = static_cast<const unsigned char *>(data);
+            for (size_t at = 0; at < size; at++) {
+                hash = (hash ^ bytes[at]) * FNV_PRIME;
+            }
+            return hash;
+        }
+
+        inline uint64_t fnv1a(uint64_t hash, const fixedmpz &x) {
+            const int64_t size = x.get_mpz_t()->_mp_size;
+            hash = fnv1a(hash, &size, sizeof(size));
+            return fnv1a(hash, mpz_limbs_read(x.get_mpz_t()), mpz_size(x.get_mpz_t()) * sizeof(mp_limb_t));
+        }
+
+        /// mu_k out of the lower triangle of a seeded (not yet factored) Hankel matrix
+        inline const fixedmpz &moment(const MpMatrix &m, size_t k) {
+            const size_t last = m.getDim() - 1;
+            return (k <= last) ? m[0][k] : m[k - last][last];
+        }
+
+        /// hashes[i] covers mu_0 ... mu_2i, for every row of m
+        inline std::vector<uint64_t> prefix_hashes(const MpMatrix &m) {
+            std::vector<uint64_t> hashes(m.getDim());
+            uint64_t hash = fnv1a(FNV_OFFSET, moment(m, 0));
+            for (size_t i = 0; i < hashes.size(); i++) {
+                if (i > 0) {
+                    hash = fnv1a(hash, moment(m, 2 * i - 1));
+                    hash = fnv1a(hash, moment(m, 2 * i));
+                }
+                hashes[i] = hash;
+            }
+            return hashes;
+        }
+
+        inline size_t write_record(char *at, const fixedmpz &x) {
+            const int64_t limbs = x.get_mpz_t()->_mp_size;
+            const size_t bytes = mpz_size(x.get_mpz_t()) * sizeof(mp_limb_t);
+
+            std::memcpy(at, &limbs, sizeof(limbs));
+            std::memcpy(at + sizeof(limbs), mpz_limbs_read(x.get_mpz_t()), bytes);
+            return sizeof(limbs) + bytes;
+        }
+
+        inline const char *read_record(const char *at, fixedmpz &x) {
+            int64_t limbs;
+            std::memcpy(&limbs, at, sizeof(limbs));
+            const size_t n = size_t(limbs < 0 ? -limbs : limbs);
+
+            mp_limb_t *rp = mpz_limbs_write(x.get_mpz_t(), std::max<size_t>(n, 1));
+            std::memcpy(rp, at + sizeof(limbs), n * sizeof(mp_limb_t));
+            mpz_limbs_finish(x.get_mpz_t(), limbs);
+            return at + sizeof(limbs) + n * sizeof(mp_limb_t);
+        }
+    }
+
+    /**
+     * @brief The rows of an LDLt factor kept on disk for one moment sequence at one shift
+     *
+     * Opening a store maps its file (if there is one yet) and indexes its rows; nothing is read
+     * into memory until load().
+     */
+    class FactorStore {
+      private:
+        std::string path;
+        fmpz_shift_t shift;
+        std::unique_ptr<MappedFile> file;
+        std::vector<size_t> offsets;    ///< where each row starts, plus where the last one ends
+
+        size_t end_of_rows() const {
+            return this->offsets.empty() ? factor_store_detail::HEADER : this->offsets.back();
+        }
+
+      public:
+        /**
+         * @param path file of the store; it is created by the first append() if it doesn't exist
+         * @param shift shift of the factor; a store at any other shift is rejected
+         */
+        FactorStore(const std::string &path, fmpz_shift_t shift) : path(path), shift(shift) {
+            using namespace factor_store_detail;
+
+            struct stat info;
+            if (stat(path.c_str(), &info) != 0) {
+                return;
+            }
+
+            this->file = std::make_unique<MappedFile>(path);
+            const char *data = this->file->begin();
+            const size_t size = this->file->size();
+
+            uint32_t fields[2];
+            uint64_t sizes[2];
+            if (size < HEADER || std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0) {
+                throw std::runtime_error(path + " is not a factor store");
+            }
+            std::memcpy(fields, data + sizeof(MAGIC), sizeof(fields));
+            std::memcpy(sizes, data + sizeof(MAGIC) + sizeof(fields), sizeof(sizes));
+
+            if (fields[0] != VERSION || fields[1] != GMP_NUMB_BITS || sizes[0] != shift) {
+                throw std::runtime_error(path + " has an unsupported version, limb size or shift");
+            }
+
+            // Rows are variable length, so find where each one starts
+            size_t at = HEADER;
+            for (size_t row = 0; row < sizes[1]; row++) {
+                this->offsets.push_back(at);
+                at += sizeof(uint64_t);
+                for (size_t k = 0; k <= row; k++) {
+                    int64_t limbs;
+                    if (at + sizeof(limbs) > size) {
+                        throw std::runtime_error("Truncated factor store " + path);
+                    }
+                    std::memcpy(&limbs, data + at, sizeof(limbs));
+                    at += sizeof(limbs) + size_t(limbs < 0 ? -limbs : limbs) * sizeof(mp_limb_t);
+                }
+            }
+            if (at > size) {
+                throw std::runtime_error("Truncated factor store " + path);
+            }
+            this->offsets.push_back(at);
+
+            // Indexing touched every page; nothing more is needed of them until load()
+            this->file->release(0, size);
+        }
+
+        /**
+         * @brief Where the store of a sequence at a shift lives inside directory
+         *
+         * @param sequence hash identifying the moment sequence (see sequence_hash())
+         */
+        static std::string path_for(const std::string &directory, uint64_t sequence, fmpz_shift_t shift) {
+            char name[64];
+            std::snprintf(name, sizeof(name), "%016llx-%lu.mpfs", (unsigned long long) sequence,
+                          (unsigned long) shift);
+            return directory + "/" + name;
+        }
+
+        /**
+         * @brief Hash naming the sequence read from a --moments file (or the built-in one, for "")
+         */
+        static uint64_t sequence_hash(const std::string &moments_path) {
+            using namespace factor_store_detail;
+            const char builtin[] = "2 (2k + 1)!";
+
+            if (moments_path.empty()) {
+                return fnv1a(FNV_OFFSET, builtin, sizeof(builtin) - 1);
+            }
+            MappedFile moments(moments_path);
+            return fnv1a(FNV_OFFSET, moments.begin(), moments.size());
+        }
+
+        /// Number of leading rows of the factor the store holds
+        size_t getRows() const {
+            return this->offsets.empty() ? 0 : this->offsets.size() - 1;
+        }
+
+        const std::string &getPath() const {
+            return this->path;
+        }
+
+        /**
+         * @brief Hashes of the moments each row of the factor of m depends on, for matching_rows()
+         * and append()
+         *
+         * @param m a seeded (not yet factored) moment matrix
+         */
+        static std::vector<uint64_t> row_hashes(const MpMatrix &m) {
+            return factor_store_detail::prefix_hashes(m);
+        }
+
+        /**
+         * @brief Number of leading rows that were stored for the same moments as the hashes are of
+         *
+         * 0 for a store of another sequence altogether.
+         */
+        size_t matching_rows(const std::vector<uint64_t> &hashes) const {
+            const size_t rows = std::min(this->getRows(), hashes.size());
+            if (rows == 0) {
+                return 0;
+            }
+
+            size_t matching = 0;
+            while (matching < rows) {
+                uint64_t stored;
+                std::memcpy(&stored, this->file->begin() + this->offsets[matching], sizeof(stored));
+                if (stored != hashes[matching]) {
+                    break;
+                }
+                matching++;
+            }
+
+            return matching;
+        }
+
+        /**
+         * @brief Writes the leading rows x rows block of C over the lower triangle of c
+         *
+         * c is column-oriented, as cholesky_decompose() fills its undivided matrix. The rows are
+         * read a block at a time, and the pages of each block let go once read, so that C isn't
+         * held in memory twice.
+         */
+        void load(MpMatrix &c, size_t rows) const {
+            using namespace factor_store_detail;
+
+            for (size_t begin = 0, end; begin < rows; begin = end) {
+                end = begin + 1;
+                while (end < rows && this->offsets[end + 1] - this->offsets[begin] <= BLOCK) {
+                    end++;
+                }
+
+                #pragma omp parallel for schedule(dynamic, 1)
+                for (size_t row = begin; row < end; row++) {
+                    const char *at = this->file->begin() + this->offsets[row] + sizeof(uint64_t);
+                    for (size_t k = 0; k <= row; k++) {
+                        at = read_record(at, c[k][row]);
+                    }
+                }
+                this->file->release(this->offsets[begin], this->offsets[end] - this->offsets[begin]);
+            }
+        }
+
+        /**
+         * @brief Appends rows [getRows(), c.getDim()) of C (column-oriented, as cholesky_decompose()
+         * fills its undivided matrix) to the store
+         *
+         * @param hashes row_hashes() of the matrix C was factored from
+         */
+        void append(const MpMatrix &c, const std::vector<uint64_t> &hashes) {
+            using namespace factor_store_detail;
+
+            const size_t first = this->getRows();
+            const size_t dim = c.getDim();
+            if (first >= dim) {
+                return;
+            }
+
+            std::vector<size_t> sizes(dim - first + 1, 0);
+            #pragma omp parallel for schedule(dynamic, 16)
+            for (size_t row = first; row < dim; row++) {
+                size_t size = sizeof(uint64_t);
+                for (size_t k = 0; k <= row; k++) {
+                    size += export_detail::record_size(c[k][row]);
+                }
+                sizes[row - first + 1] = size;
+            }
+            for (size_t r = 1; r < sizes.size(); r++) {
+                sizes[r] += sizes[r - 1];
+            }
+
+            const size_t offset = this->end_of_rows();
+            this->file.reset();
+
+            std::fstream out(this->path, std::ios::binary | std::ios::in | std::ios::out);
+            if (!out) {
+                out.open(this->path, std::ios::binary | std::ios::out | std::ios::trunc);
+                const uint32_t fields[2] = {VERSION, GMP_NUMB_BITS};
+                const uint64_t header_sizes[2] = {this->shift, 0};
+                out.write(MAGIC, sizeof(MAGIC));
+                out.write(reinterpret_cast<const char *>(fields), sizeof(fields));
+                out.write(reinterpret_cast<const char *>(header_sizes), sizeof(header_sizes));
+            }
+
+            // Rows first, then the count that makes them part of the store. They are put together
+            // and written a block at a time, so the buffer stays small next to C.
+            out.seekp(offset);
+            std::vector<char> buffer;
+            for (size_t begin = first, end; begin < dim && out; begin = end) {
+                end = begin + 1;
+                while (end < dim && sizes[end + 1 - first] - sizes[begin - first] <= BLOCK) {
+                    end++;
+                }
+
+                buffer.resize(sizes[end - first] - sizes[begin - first]);
+                #pragma omp parallel for schedule(dynamic, 1)
+                for (size_t row = begin; row < end; row++) {
+                    char *at = buffer.data() + sizes[row - first] - sizes[begin - first];
+                    std::memcpy(at, &hashes[row], sizeof(uint64_t));
+                    at += sizeof(uint64_t);
+                    for (size_t k = 0; k <= row; k++) {
+                        at += write_record(at, c[k][row]);
+                    }
+                }
+                out.write(buffer.data(), buffer.size());
+            }
+            out.flush();
+
+            const uint64_t rows = dim;
+            out.seekp(ROWS_FIELD);
+            out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+            out.flush();
+            if (!out) {
+                throw std::runtime_error("Failed writing factor store " + this->path);
+            }
+
+            if (this->offsets.empty()) {
+                this->offsets.push_back(offset);
+            }
+            for (size_t r = 1; r < sizes.size(); r++) {
+                this->offsets.push_back(offset + sizes[r]);
+            }
+            this->file = std::make_unique<MappedFile>(this->path);
+        }
+    };
+
+    /**
+     * @brief Finishes the factorization of m given the leading known x known block of its C = LD
+     *
+     * m holds the seeded M and c the undivided factor C of its leading block (e.g. from
+     * FactorStore::load()); on return m holds the whole factor, L with D on the diagonal, and c the
+     * whole of C, just as cholesky_decompose(m, ..., &c) would leave them. The known block of m is
+     * divided out of c, and then:
+     *
+     *  1. every new row i >= known is eliminated against the known columns, in parallel over rows:
+     *     C[i][k] = M[i][k] - sum over m < k of C[k][m] L[i][m], and L[i][k] = C[i][k] / d_k;
+     *  2. the trailing block is updated by the same sums, S[i][j] -= sum over m < known of
+     *     C[j][m] L[i][m], in parallel over columns;
+     *  3. the Schur complement S left in the trailing block is factored by cholesky_decompose().
+     *
+     * Every element receives the same updates, with the same operands and in the same order, as in
+     * cholesky_decompose() on the whole matrix; the new rows being but a fraction of the matrix,
+     * this costs about (dim - known) * known^2 / 2 products against dim^3 / 6. The one difference is
+     * that a pivot's reciprocal is sized for the column as far as it is known beforehand, so the
+     * divisions can land the few ulps apart fixedmpz_reciprocal allows.
+     *
+     * The new pivots are checked against the guard (as cholesky_decompose() does) once the
+     * trailing block has been factored.
+     */
+    inline void extend_factor(MpMatrix &m, MpMatrix &c, size_t known, const KroneckerPolicy &policy = KroneckerPolicy(),
+                              const PrecisionGuard &guard = PrecisionGuard()) {
+        const size_t dim = m.getDim();
+        const auto shift = m.getShift();
+        known = std::min(known, dim);
+
+        std::vector<size_t> diagonal_bits(dim);
+        for (size_t k = known; k < dim; k++) {
+            diagonal_bits[k] = mpz_sizeinbase(m[k][k].get_mpz_t(), 2);
+        }
+
+        // The known block of L, and reciprocals of its pivots sized for everything in their columns
+        // so far (anything larger by the time it is divided falls back on a true division)
+        std::vector<fixedmpz_reciprocal> reciprocals;
+        for (size_t k = 0; k < known; k++) {
+            mp_bitcnt_t precision = 0;
+            for (size_t row = k + 1; row < known; row++) {
+                precision = std::max(precision, mpz_sizeinbase(c[k][row].get_mpz_t(), 2));
+            }
+            for (size_t row = known; row < dim; row++) {
+                precision = std::max(precision, mpz_sizeinbase(m[k][row].get_mpz_t(), 2));
+            }
+            reciprocals.emplace_back(c[k][k], precision);
+        }
+
+        // m[k][row] = C[k][row] / d_k, in storage of its own size as cholesky_decompose() leaves it
+        auto divide = [&](size_t k, size_t row, mpz_class &scratch) {
+            reciprocals[k].divide(scratch, c[k][row]());
+            mpz_class quotient(scratch);
+            m[k][row]().swap(quotient);
+        };
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t k = 0; k < known; k++) {
+            mpz_class scratch;
+            m[k][k] = c[k][k];
+            for (size_t row = k + 1; row < known; row++) {
+                divide(k, row, scratch);
+            }
+        }
+
+        if (known == dim) {
+            return;
+        }
+
+        // 1. New rows against the known columns
+        #pragma omp parallel for schedule(runtime)
+        for (size_t row = known; row < dim; row++) {
+            mpz_class scratch;
+            for (size_t k = 0; k < known; k++) {
+                std::swap(c[k][row](), m[k][row]());
+                c[k][row].shrink_to_fit();
+                divide(k, row, scratch);
+
+                const auto &l = m[k][row];
+                for (size_t next = k + 1; next < known; next++) {
+                    m[next][row] -= c[k][next] * l;
+                }
+            }
+        }
+
+        // 2. Their contribution to the trailing block
+        #pragma omp parallel for schedule(runtime)
+        for (size_t col = known; col < dim; col++) {
+            for (size_t row = col; row < dim; row++) {
+                auto &z = m[col][row];
+                for (size_t k = 0; k < known; k++) {
+                    z -= c[k][col] * m[k][row];
+                }
+            }
+        }
+
+        // 3. The Schur complement, moved out (not copied) to be factored as a matrix of its own
+        MpMatrix schur(dim - known, shift, COL_ORIENTED);
+        MpMatrix schur_c(dim - known, shift, COL_ORIENTED);
+        for (size_t col = known; col < dim; col++) {
+            for (size_t row = col; row < dim; row++) {
+                std::swap(schur[col - known][row - known](), m[col][row]());
+            }
+        }
+
+        cholesky_decompose(schur, policy, PrecisionGuard{false}, SIZE_MAX, &schur_c);
+
+        for (size_t col = known; col < dim; col++) {
+            for (size_t row = col; row < dim; row++) {
+                std::swap(schur[col - known][row - known](), m[col][row]());
+                std::swap(schur_c[col - known][row - known](), c[col][row]());
+            }
+        }
+
+        for (size_t k = known; k < dim; k++) {
+            check_pivot(guard, m[k][k], diagonal_bits[k], k, dim);
+        }
+    }
+
+    /**
+     * @brief cholesky_decompose() of a seeded m, reusing and then extending the factor in a store
+     *
+     * Loads as many leading rows as the store holds for this sequence, factors only the rest (see
+     * extend_factor(); everything, if the store is empty), and appends the new rows to the store. A
+     * store whose sequence only agrees for some leading rows (or none) is used for those, but left
+     * as it is. C is kept alongside the factor throughout, so this takes twice the memory of
+     * cholesky_decompose().
+     *
+     * Returns the number of rows reused. If the new rows can't be written, m is factored all the
+     * same and the error thrown afterwards.
+     */
+    inline size_t stored_cholesky(MpMatrix &m, FactorStore &store, const KroneckerPolicy &policy = KroneckerPolicy(),
+                                  const PrecisionGuard &guard = PrecisionGuard()) {
+        const auto hashes = FactorStore::row_hashes(m);
+        const size_t known = store.matching_rows(hashes);
+        MpMatrix c(m.getDim(), m.getShift(), COL_ORIENTED);
+
+        if (known == 0) {
+            cholesky_decompose(m, policy, guard, SIZE_MAX, &c);
+        } else {
+            store.load(c, known);
+            extend_factor(m, c, known, policy, guard);
+        }
+
+        if (known == store.getRows()) {
+            store.append(c, hashes);
+        }
+        return known;
+    }
+}
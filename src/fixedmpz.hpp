@@ -8,18 +8,74 @@
 #pragma once
 
 #include <gmpxx.h>
+#include <algorithm>
+#include <cmath>
 #include <iostream>
+#include <stdexcept>
 #include <string>
 
+#include "parallel_mul.hpp"
+
 namespace momentmp {
     // forward declaration for the class below; allows the aliases immediately following to work.
     class fixedmpz;
+    class fixedmpz_reciprocal;
 
     using fmp_t = fixedmpz; ///< convenience alias to the underlying number type used for operations
 
     /** Alias for fixedmpz's underlying type representing the where the "dot" goes (in base 2) */
     using fmpz_shift_t = mp_bitcnt_t;
 
+    /**
+     * @brief dest = floor(a * b / 2^shift), give or take an ulp, from only the high part of the product
+     *
+     * The low shift bits of the full product are thrown away, so any part of an operand that only
+     * ever lands down there need not be multiplied at all. With b under 2^(shift - 2) in magnitude
+     * (a value below a quarter), the bits of a below 2^(shift - bits(b) - 2) add up to less than a
+     * quarter ulp of the result, and likewise the other way around; whole limbs of both are
+     * dropped before multiplying. The two dropped parts together are under half an ulp, so the
+     * result is within one ulp of the exact floor(a * b / 2^shift). When neither operand is that
+     * small (nothing can be dropped), it is exactly the floor.
+     *
+     * GMP offers no short product for operands of similar size, and computing one out of smaller
+     * full products comes out slower than the single mpz_mul over the sizes used here, so those
+     * products are left whole.
+     *
+     * dest may alias a or b.
+     */
+    inline void mul_high(mpz_class &dest, const mpz_class &a, const mpz_class &b, fmpz_shift_t shift) {
+        const mp_bitcnt_t a_bits = mpz_sizeinbase(a.get_mpz_t(), 2);
+        const mp_bitcnt_t b_bits = mpz_sizeinbase(b.get_mpz_t(), 2);
+
+        mp_bitcnt_t a_drop = 0, b_drop = 0;
+        if (shift > b_bits + 2) {
+            a_drop = std::min<mp_bitcnt_t>(shift - b_bits - 2, a_bits) / GMP_NUMB_BITS * GMP_NUMB_BITS;
+        }
+        if (shift > a_bits + 2) {
+            b_drop = std::min<mp_bitcnt_t>(shift - a_bits - 2, b_bits) / GMP_NUMB_BITS * GMP_NUMB_BITS;
+        }
+
+        if (a_drop + b_drop == 0) {
+            parallel_multiply(dest, a, b);
+            mpz_fdiv_q_2exp(dest.get_mpz_t(), dest.get_mpz_t(), shift);
+            return;
+        }
+
+        // Below a sixteenth of an ulp in magnitude: floor is 0 or -1 and there is nothing to multiply
+        if (a_bits + b_bits + 4 <= shift) {
+            const bool negative = sgn(a) * sgn(b) < 0;
+            dest = negative ? -1 : 0;
+            return;
+        }
+
+        mpz_class a_high, b_high;
+        mpz_tdiv_q_2exp(a_high.get_mpz_t(), a.get_mpz_t(), a_drop);
+        mpz_tdiv_q_2exp(b_high.get_mpz_t(), b.get_mpz_t(), b_drop);
+
+        parallel_multiply(dest, a_high, b_high);
+        mpz_fdiv_q_2exp(dest.get_mpz_t(), dest.get_mpz_t(), shift - a_drop - b_drop);
+    }
+
     /**
      * @brief mpz_class based class purposed for fixed-precision arithmetic.
      *
@@ -76,6 +132,27 @@ namespace momentmp {
             return shiftd;
         }
 
+        /**
+         * @brief Returns the number as d * 2^exponent, with 0.5 <= |d| < 1 (or d = 0)
+         *
+         * d is read straight off the top limbs (truncated, as to_mpf().get_d() would be), so this
+         * allocates nothing, and keeps the range of numbers too far from 1 for a double.
+         */
+        double get_d_2exp(long &exponent) const {
+            double d = mpz_get_d_2exp(&exponent, this->get_mpz_t());
+            exponent -= long(this->shift);
+            return d;
+        }
+
+        /**
+         * @brief Returns the number as a double, read straight off the top limbs
+         */
+        double get_d() const {
+            long exponent;
+            double d = this->get_d_2exp(exponent);
+            return std::ldexp(d, int(exponent));
+        }
+
         /**
          * @brief Return underlying mpz_class
          */
@@ -102,6 +179,23 @@ namespace momentmp {
         fixedmpz &operator=(const fixedmpz &other) = default;
         fixedmpz &operator=(fixedmpz &&other) = default;
 
+        /**
+         * @brief Gives back the limbs the number has outgrown
+         *
+         * An in-place subtraction keeps the storage its largest intermediate needed, so a number
+         * whose digits cancelled away goes on holding the limbs it once had. The number is moved
+         * into a fresh block of just its size rather than shrunk where it is: a shrunk block only
+         * frees its tail, and the heap ends up riddled with slivers too small to reuse, whereas a
+         * whole block freed can merge with its neighbours.
+         */
+        void shrink_to_fit() {
+            auto size = std::max<mp_size_t>(mpz_size(this->get_mpz_t()), 1);
+            if (this->get_mpz_t()->_mp_alloc > size) {
+                mpz_class tight(this->number);
+                this->number.swap(tight);
+            }
+        }
+
         fixedmpz &operator+=(const fixedmpz &addend) {
             this->number += addend.number;
             return *this;
@@ -112,18 +206,21 @@ namespace momentmp {
             return *this;
         }
 
+        /// Truncated to the high part of the product, see mul_high() for the (one ulp) error bound
         fixedmpz &operator*=(const fixedmpz &multiplier) {
-            this->number *= multiplier.number;
-            this->number >>= this->shift;
+            mul_high(this->number, this->number, multiplier.number, this->shift);
             return *this;
         }
 
+        /// Exact (truncated towards zero); GMP's division already reads only what the quotient needs
         fixedmpz &operator/=(const fixedmpz &divisor) {
             this->number <<= this->shift;
             this->number /= divisor.number;
             return *this;
         }
 
+        fixedmpz &operator/=(const fixedmpz_reciprocal &reciprocal);
+
         fixedmpz &operator>>=(const fmpz_shift_t &amount) {
             this->number >>= amount;
             return *this;
@@ -163,6 +260,180 @@ namespace momentmp {
         return lhs;
     }
 
+    /**
+     * @brief Precomputed reciprocal of a fixedmpz, turning repeated division by it into multiplication
+     *
+     * Holds R = floor(2^(shift + precision) / |d|), found by Newton iteration on the reciprocal
+     * followed by an exact remainder correction. Dividing a number whose underlying mpz has at most
+     * <code>precision</code> bits is then a single multiply and shift. Low bits of the dividend that
+     * cannot reach the quotient are dropped before multiplying, as are the low bits of R itself that
+     * a dividend shorter than <code>precision</code> cannot carry into the quotient (a short
+     * product, so a column of mixed sizes pays only for the bits each entry has). The result is at
+     * most three ulps closer to zero than the exactly truncated quotient.
+     *
+     * Dividends larger than <code>precision</code>, or so much larger than the divisor that GMP's
+     * own (then nearly linear) division is cheaper than the multiply, fall back to a true division.
+     */
+    class fixedmpz_reciprocal {
+      private:
+        mpz_class inverse;
+        mpz_class divisor;
+        fmpz_shift_t shift;
+        mp_bitcnt_t precision;
+        mp_bitcnt_t divisor_bits;
+
+      public:
+        /**
+         * @brief floor(2^exponent / d) for d > 0, via Newton's iteration r' = 2r - d*r^2
+         *
+         * Each step squares the relative error of the one before, so an error of e units at p bits
+         * would come out as about e^2 units at 2p bits, and grow without bound over the doublings.
+         * The iteration carries a limb of guard bits past the ones it means to get right, which
+         * keeps e at a few units, and the result is pinned down to the exact floor by one division
+         * of the remainder at the end, which costs no more than a multiplication when y is close.
+         */
+        static mpz_class newton_inverse(const mpz_class &d, mp_bitcnt_t exponent) {
+            const mp_bitcnt_t n = mpz_sizeinbase(d.get_mpz_t(), 2);
+            const mp_bitcnt_t seed = 50;
+            const mp_bitcnt_t guard = GMP_NUMB_BITS;
+            mpz_class y, a, t;
+
+            if (exponent < n + 2 * seed) {
+                mpz_class num(1);
+                num <<= exponent;
+                mpz_fdiv_q(y.get_mpz_t(), num.get_mpz_t(), d.get_mpz_t());
+                return y;
+            }
+
+            // a to w bits of precision: d / 2^(n - w), so that 2^(2w) / a ~ 2^(n + w) / d
+            auto truncate = [&](mp_bitcnt_t w) {
+                if (n > w) {
+                    a = d >> (n - w);
+                } else {
+                    a = d << (w - n);
+                }
+            };
+
+            // Working value: y ~ 2^(n + p + guard) / d, good to about p bits
+            const mp_bitcnt_t target = exponent - n;
+            mp_bitcnt_t p = seed;
+            truncate(p + guard);
+            y = 1;
+            y <<= 2 * (p + guard);
+            y /= a;
+
+            while (p < target) {
+                const mp_bitcnt_t q = std::min(2 * p, target);
+                truncate(q + guard);
+
+                parallel_multiply(t, a, y);
+                parallel_multiply(t, t, y);
+                t >>= 2 * (p + guard);
+                y <<= q - p + 1;
+                y -= t;
+                p = q;
+            }
+            y >>= guard;
+
+            // y is now within a few units of the true floor; one division of the remainder by d
+            // takes it the rest of the way
+            mpz_class pow(1), r, correction;
+            pow <<= exponent;
+            parallel_multiply(r, d, y);
+            r = pow - r;
+            mpz_fdiv_q(correction.get_mpz_t(), r.get_mpz_t(), d.get_mpz_t());
+            y += correction;
+
+            return y;
+        }
+
+        /**
+         * @param divisor the (nonzero) fixedmpz that will be divided by
+         * @param precision largest dividend size, in bits, that the fast path should cover
+         */
+        fixedmpz_reciprocal(const fixedmpz &divisor, mp_bitcnt_t precision)
+                : divisor(abs(divisor())), shift(divisor.getShift()), precision(precision) {
+            if (this->divisor == 0) {
+                throw std::domain_error("Cannot take the reciprocal of zero");
+            }
+
+            this->divisor_bits = mpz_sizeinbase(this->divisor.get_mpz_t(), 2);
+
+            this->inverse = newton_inverse(this->divisor, this->shift + precision);
+            if (sgn(divisor()) < 0) {
+                this->inverse = -this->inverse;
+                this->divisor = -this->divisor;
+            }
+        }
+
+        fixedmpz_reciprocal(const fixedmpz_reciprocal &other) = default;
+        fixedmpz_reciprocal(fixedmpz_reciprocal &&other) = default;
+        fixedmpz_reciprocal &operator=(const fixedmpz_reciprocal &other) = default;
+        fixedmpz_reciprocal &operator=(fixedmpz_reciprocal &&other) = default;
+
+        /// Returns the largest dividend size (in bits) handled by multiplication
+        mp_bitcnt_t getPrecision() const {
+            return this->precision;
+        }
+
+        /**
+         * @brief Replaces number (the underlying mpz of a fixedmpz) with number / divisor
+         */
+        void divide(mpz_class &number) const {
+            divide(number, number);
+        }
+
+        /**
+         * @brief Sets result to number / divisor, leaving number as it was (unless it is result)
+         *
+         * The result is built in its own storage, so a dividend that is about to be thrown away
+         * needn't be copied first.
+         */
+        void divide(mpz_class &result, const mpz_class &number) const {
+            const mp_bitcnt_t bits = mpz_sizeinbase(number.get_mpz_t(), 2);
+            const mp_bitcnt_t scaled = bits + this->shift;
+            const mp_bitcnt_t quotient = scaled - std::min(scaled, this->divisor_bits);
+
+            if (bits <= this->precision && 2 * this->divisor_bits >= quotient) {
+                // bits below 2^(divisor_bits - shift - 2) contribute under half an ulp
+                mp_bitcnt_t drop = 0;
+                if (this->divisor_bits > this->shift + 2) {
+                    drop = std::min(this->divisor_bits - this->shift - 2, bits);
+                }
+
+                mpz_tdiv_q_2exp(result.get_mpz_t(), number.get_mpz_t(), drop);
+
+                // and R's bits below 2^(precision - bits - 2) contribute under a quarter ulp
+                mp_bitcnt_t inverse_drop = 0;
+                if (this->precision > bits + 2) {
+                    inverse_drop = (this->precision - bits - 2) / GMP_NUMB_BITS * GMP_NUMB_BITS;
+                }
+
+                if (inverse_drop > 0) {
+                    mpz_class inverse;
+                    mpz_tdiv_q_2exp(inverse.get_mpz_t(), this->inverse.get_mpz_t(), inverse_drop);
+                    parallel_multiply(result, result, inverse);
+                } else {
+                    parallel_multiply(result, result, this->inverse);
+                }
+                mpz_tdiv_q_2exp(result.get_mpz_t(), result.get_mpz_t(), this->precision - drop - inverse_drop);
+            } else {
+                mpz_mul_2exp(result.get_mpz_t(), number.get_mpz_t(), this->shift);
+                result /= this->divisor;
+            }
+        }
+    };
+
+    inline fixedmpz &fixedmpz::operator/=(const fixedmpz_reciprocal &reciprocal) {
+        reciprocal.divide(this->number);
+        return *this;
+    }
+
+    inline fixedmpz operator/(fixedmpz lhs, const fixedmpz_reciprocal &rhs) {
+        lhs /= rhs;
+        return lhs;
+    }
+
     inline fixedmpz operator>>(fixedmpz lhs, const fmpz_shift_t &rhs) {
         lhs >>= rhs;
         return lhs;
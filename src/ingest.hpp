@@ -0,0 +1,389 @@
+/**
+ * @brief Reading moment sequences in from files, so other measures than the built-in one can be used
+ *
+ * Files are memory-mapped and parsed in parallel straight into fixedmpz at the target shift, with
+ * no per-value strings in between. Two kinds of file are accepted:
+ *
+ * - binary, in the array layout written by export_array() (see export.hpp), with values at any
+ *   shift (they are rescaled to the target shift);
+ * - text, whitespace-separated values, each either a decimal number ([-]digits[.digits]) or a C99
+ *   hex float ([-]0x<hex digits>[p[-]<exponent>], as written by the hex exporter). Lines starting
+ *   with '#' are comments.
+ *
+ * Decimal fractions that don't fit in the shift are truncated toward zero, as with fixedmpz
+ * division; everything else is read exactly.
+ *
+ * @file ingest.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <gmpxx.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "export.hpp"
+#include "fixedmpz.hpp"
+#include "mpmatrix.hpp"
+
+namespace momentmp {
+    /**
+     * @brief A read-only memory mapping of a whole file, unmapped on destruction
+     */
+    class MappedFile {
+      private:
+        const char *data = nullptr;
+        size_t length = 0;
+
+      public:
+        explicit MappedFile(const std::string &path) {
+            int fd = open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw std::runtime_error("Cannot open " + path);
+            }
+
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                close(fd);
+                throw std::runtime_error("Cannot stat " + path);
+            }
+
+            this->length = info.st_size;
+            if (this->length > 0) {
+                void *map = mmap(nullptr, this->length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (map == MAP_FAILED) {
+                    close(fd);
+                    throw std::runtime_error("Cannot map " + path);
+                }
+                madvise(map, this->length, MADV_WILLNEED);
+                this->data = static_cast<const char *>(map);
+            }
+            close(fd);
+        }
+
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        ~MappedFile() {
+            if (this->data) {
+                munmap(const_cast<char *>(this->data), this->length);
+            }
+        }
+
+        const char *begin() const {
+            return this->data;
+        }
+
+        /**
+         * @brief Drops the pages of length bytes from offset on out of the resident set
+         *
+         * The mapping stays, and a page touched again is read back in from the file.
+         */
+        void release(size_t offset, size_t length) const {
+            const size_t page = size_t(sysconf(_SC_PAGESIZE));
+            const size_t first = offset / page * page;
+            const size_t last = std::min(offset + length, this->length);
+            if (this->data && last > first) {
+                madvise(const_cast<char *>(this->data) + first, last - first, MADV_DONTNEED);
+            }
+        }
+
+        const char *end() const {
+            return this->data + this->length;
+        }
+
+        size_t size() const {
+            return this->length;
+        }
+    };
+
+    namespace ingest_detail {
+        inline bool is_space(char c) {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+        }
+
+        inline int digit_value(char c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return 99;
+        }
+
+        /// dest = the digits in [first, last) read in base; returns false on a bad digit
+        inline bool read_digits(mpz_class &dest, const char *first, const char *last, int base,
+                                std::vector<unsigned char> &scratch) {
+            scratch.clear();
+            for (auto at = first; at < last; at++) {
+                int value = digit_value(*at);
+                if (value >= base) {
+                    return false;
+                }
+                if (!scratch.empty() || value != 0) {
+                    scratch.push_back(value);
+                }
+            }
+
+            if (scratch.empty()) {
+                dest = 0;
+                return true;
+            }
+
+            // mpn_set_str needs room for every limb the digits could make; at most 4 bits per digit
+            size_t limbs = (scratch.size() * 4) / GMP_NUMB_BITS + 2;
+            mp_limb_t *rp = mpz_limbs_write(dest.get_mpz_t(), limbs);
+            mp_size_t used = mpn_set_str(rp, scratch.data(), scratch.size(), base);
+            mpz_limbs_finish(dest.get_mpz_t(), used);
+            return true;
+        }
+
+        /// dest = x * 2^exp, truncated toward zero
+        inline void scale2(mpz_class &x, long exp) {
+            if (exp >= 0) {
+                mpz_mul_2exp(x.get_mpz_t(), x.get_mpz_t(), exp);
+            } else {
+                mpz_tdiv_q_2exp(x.get_mpz_t(), x.get_mpz_t(), -exp);
+            }
+        }
+
+        /**
+         * @brief Parses one token into dest at the given shift; returns false if malformed
+         */
+        inline bool parse_value(fixedmpz &dest, const char *first, const char *last, fmpz_shift_t shift,
+                                std::vector<unsigned char> &scratch) {
+            bool negative = false;
+            if (first < last && (*first == '-' || *first == '+')) {
+                negative = (*first == '-');
+                first++;
+            }
+
+            mpz_class &number = dest();
+            dest.setShift(shift);
+
+            if (last - first > 2 && first[0] == '0' && (first[1] == 'x' || first[1] == 'X')) {
+                first += 2;
+                auto p = std::find_if(first, last, [](char c) { return c == 'p' || c == 'P'; });
+                if (p == first || !read_digits(number, first, p, 16, scratch)) {
+                    return false;
+                }
+
+                long exp = 0;
+                if (p < last) {
+                    auto at = p + 1;
+                    bool exp_negative = (at < last && *at == '-');
+                    at += (at < last && (*at == '-' || *at == '+'));
+                    if (at == last) {
+                        return false;
+                    }
+                    for (; at < last; at++) {
+                        if (*at < '0' || *at > '9') {
+                            return false;
+                        }
+                        exp = exp * 10 + (*at - '0');
+                    }
+                    exp = exp_negative ? -exp : exp;
+                }
+
+                scale2(number, exp + long(shift));
+            } else {
+                auto point = std::find(first, last, '.');
+                auto fraction = (point < last) ? point + 1 : last;
+                if (point == first && fraction == last) {
+                    return false;
+                }
+
+                // whole part, plus the fraction digits scaled by 2^shift / 10^(number of them)
+                mpz_class whole, frac;
+                if (!read_digits(whole, first, point, 10, scratch)
+                        || !read_digits(frac, fraction, last, 10, scratch)) {
+                    return false;
+                }
+
+                number = whole;
+                number <<= shift;
+                if (fraction < last) {
+                    mpz_class ten_pow;
+                    mpz_ui_pow_ui(ten_pow.get_mpz_t(), 10, last - fraction);
+                    frac <<= shift;
+                    frac /= ten_pow;
+                    number += frac;
+                }
+            }
+
+            if (negative) {
+                mpz_neg(number.get_mpz_t(), number.get_mpz_t());
+            }
+            return true;
+        }
+
+        /**
+         * @brief Calls fn(first, last) for every value token in the lines of [begin, end)
+         */
+        template <typename Fn>
+        inline void for_tokens(const char *begin, const char *end, Fn &&fn) {
+            const char *at = begin;
+            while (at < end) {
+                if (*at == '#') {
+                    at = std::find(at, end, '\n');
+                    continue;
+                }
+                if (is_space(*at)) {
+                    at++;
+                    continue;
+                }
+
+                const char *start = at;
+                while (at < end && !is_space(*at)) {
+                    at++;
+                }
+                fn(start, at);
+            }
+        }
+
+        inline void read_text(const MappedFile &file, fmpz_shift_t shift, MpArray &dest) {
+            // Chunks start on line boundaries, so a comment is always seen from its '#'
+            const size_t chunks = std::max(omp_get_max_threads(), 1) * 4;
+            std::vector<const char *> bounds(chunks + 1, file.end());
+            bounds[0] = file.begin();
+            for (size_t c = 1; c < chunks; c++) {
+                auto guess = std::max(bounds[c - 1], file.begin() + file.size() * c / chunks);
+                auto newline = std::find(guess, file.end(), '\n');
+                bounds[c] = (newline < file.end()) ? newline + 1 : file.end();
+            }
+
+            std::vector<size_t> first_index(chunks + 1, 0);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (size_t c = 0; c < chunks; c++) {
+                size_t count = 0;
+                for_tokens(bounds[c], bounds[c + 1], [&](const char *, const char *) { count++; });
+                first_index[c + 1] = count;
+            }
+            for (size_t c = 0; c < chunks; c++) {
+                first_index[c + 1] += first_index[c];
+            }
+
+            dest = MpArray(first_index[chunks], shift);
+            bool malformed = false;
+
+            #pragma omp parallel for schedule(dynamic, 1) reduction(||:malformed)
+            for (size_t c = 0; c < chunks; c++) {
+                std::vector<unsigned char> scratch;
+                size_t index = first_index[c];
+                for_tokens(bounds[c], bounds[c + 1], [&](const char *first, const char *last) {
+                    malformed = !parse_value(dest[index++], first, last, shift, scratch) || malformed;
+                });
+            }
+
+            if (malformed) {
+                throw std::runtime_error("Malformed value in moment file");
+            }
+        }
+
+        inline void read_binary(const MappedFile &file, fmpz_shift_t shift, MpArray &dest) {
+            const size_t header = sizeof(export_detail::MAGIC) + 3 * sizeof(uint32_t) + 3 * sizeof(uint64_t);
+            if (file.size() < header) {
+                throw std::runtime_error("Truncated moment file");
+            }
+
+            uint32_t fields[3];
+            uint64_t sizes[3];
+            std::memcpy(fields, file.begin() + sizeof(export_detail::MAGIC), sizeof(fields));
+            std::memcpy(sizes, file.begin() + sizeof(export_detail::MAGIC) + sizeof(fields), sizeof(sizes));
+
+            if (fields[0] != export_detail::VERSION || fields[1] != GMP_NUMB_BITS) {
+                throw std::runtime_error("Moment file has an unsupported version or limb size");
+            }
+
+            const size_t count = sizes[0] * sizes[1];
+            const long rescale = long(shift) - long(sizes[2]);
+
+            // Records are variable length, so find where each one starts before going parallel
+            std::vector<size_t> offsets(count);
+            size_t at = header;
+            for (size_t index = 0; index < count; index++) {
+                int64_t limbs;
+                if (at + sizeof(limbs) > file.size()) {
+                    throw std::runtime_error("Truncated moment file");
+                }
+                std::memcpy(&limbs, file.begin() + at, sizeof(limbs));
+                offsets[index] = at;
+                at += sizeof(limbs) + size_t(limbs < 0 ? -limbs : limbs) * sizeof(mp_limb_t);
+            }
+            if (at > file.size()) {
+                throw std::runtime_error("Truncated moment file");
+            }
+
+            dest = MpArray(count, shift);
+
+            #pragma omp parallel for schedule(dynamic, 64)
+            for (size_t index = 0; index < count; index++) {
+                int64_t limbs;
+                std::memcpy(&limbs, file.begin() + offsets[index], sizeof(limbs));
+                const size_t n = size_t(limbs < 0 ? -limbs : limbs);
+
+                mpz_class &number = dest[index]();
+                mp_limb_t *rp = mpz_limbs_write(number.get_mpz_t(), std::max<size_t>(n, 1));
+                std::memcpy(rp, file.begin() + offsets[index] + sizeof(limbs), n * sizeof(mp_limb_t));
+                mpz_limbs_finish(number.get_mpz_t(), n);
+
+                if (limbs < 0) {
+                    mpz_neg(number.get_mpz_t(), number.get_mpz_t());
+                }
+                scale2(number, rescale);
+            }
+        }
+    }
+
+    /**
+     * @brief Reads a moment sequence from a binary or text file (told apart by the magic number)
+     *
+     * @param shift shift the values are stored at in dest
+     * @param dest replaced with one element per value in the file
+     */
+    inline void load_moments(const std::string &path, fmpz_shift_t shift, MpArray &dest) {
+        MappedFile file(path);
+
+        if (file.size() >= sizeof(export_detail::MAGIC)
+                && std::memcmp(file.begin(), export_detail::MAGIC, sizeof(export_detail::MAGIC)) == 0) {
+            ingest_detail::read_binary(file, shift, dest);
+        } else {
+            ingest_detail::read_text(file, shift, dest);
+        }
+    }
+
+    /**
+     * @brief Fills a Hankel MpMatrix from a moment sequence: M[i][j] = moments[i + j]
+     *
+     * Like momentInit(), only the lower triangle (index >= column) is filled, and placed matrices
+     * have each column filled by its owner. moments needs at least 2 * dim - 1 elements.
+     */
+    inline void hankelInit(MpMatrix &matrix, const MpArray &moments) {
+        auto fill = [&](size_t col) {
+            auto &column = matrix[col];
+            for (size_t index = col; index < column.size(); index++) {
+                column[index] = moments[col + index];
+            }
+        };
+
+        if (auto &owners = matrix.getOwnership()) {
+            #pragma omp parallel num_threads(owners->getThreads())
+            owners->for_owned(0, matrix.getDim(), fill);
+            return;
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t col = 0; col < matrix.getDim(); col++) {
+            fill(col);
+        }
+    }
+}
@@ -7,31 +7,242 @@
  * @author jwpereira
  */
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <iomanip>
+#include <numeric>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #include <gmpxx.h>
 
+#include "arithmetic.hpp"
+#include "autotune.hpp"
 #include "demo.hpp"
 #include "eigen.hpp"
+#include "export.hpp"
+#include "factor_store.hpp"
 #include "fixedmpz.hpp"
+#include "hankel.hpp"
+#include "ingest.hpp"
+#include "memory.hpp"
 #include "mpmatrix.hpp"
 #include "moment_algorithm.hpp"
+#include "numa.hpp"
+#include "phases.hpp"
+#include "refinement.hpp"
+#include "static_matrix.hpp"
+#include "verify.hpp"
 
 using namespace momentmp;
 
 /**
- * @brief This is the size of the matrix to be handed over to the GSL eigensolver
+ * @brief Default size of the matrix to be handed over to the GSL eigensolver
+ *
+ * Can be overridden at runtime with --inv-dim=<n>.
  */
 const size_t INV_DIM = 10;
 
+/**
+ * @brief How the fixedmpz path inverts the moment matrix
+ *
+ * STRUCTURED goes through the orthogonal polynomial recurrence in O(n^2) (see hankel.hpp), DENSE
+ * factors and inverts the full matrix in O(n^3), and CHECK runs both and reports how closely they
+ * agree before carrying on with the structured result. REFINE factors at a lower working shift
+ * and refines the leading columns of the inverse back up to the full one (see refinement.hpp).
+ */
+enum class Solver { STRUCTURED, DENSE, CHECK, REFINE };
+
+/**
+ * @brief Where the reported eigenvalue comes from
+ *
+ * BLOCK takes the largest eigenvalue of the leading INV_DIM block of M^-1 (an approximation),
+ * ITERATE finds the smallest eigenvalue of M itself by inverse iteration, and BISECT brackets it by
+ * inertia counts to a guaranteed number of digits.
+ */
+enum class EigenSource { BLOCK, ITERATE, BISECT };
+
 /**
  * @brief Boolean for whether to print log statements or not to stderr
  */
 const bool DEBUG = true;
 
+/**
+ * @brief Where intermediate results get exported to (path prefix and format), if anywhere
+ *
+ * Set by --export; see export_result().
+ */
+struct ExportTarget {
+    std::string prefix;
+    ExportFormat format;
+};
+std::optional<ExportTarget> export_target;
+
+/**
+ * @brief Thread count, schedule and kernel variant the run uses
+ *
+ * Loaded from the tuning profile at startup (or found by --tune); see autotune.hpp.
+ */
+TuningConfig tuning;
+
+/**
+ * @brief Random vectors a fixedmpz factorization is checked with (see verify.hpp)
+ *
+ * Set by --verify; 0 leaves the check out.
+ */
+size_t verify_vectors = 2;
+
+/**
+ * @brief Peak resident set the dense inversion is held to (see memory.hpp)
+ *
+ * Set up from --memory-budget (and --factor-store, which keeps C alongside the factor);
+ * over_budget records whether a phase went over it.
+ */
+MemoryBudget memory_budget;
+bool over_budget = false;
+
+/**
+ * @brief Prints the outcome of a FactorVerifier's checks
+ *
+ * @param inverted whether check_inverse() ran too (it can't on paths that never invert L)
+ */
+void print_verification(const FactorVerifier &verifier, bool inverted = true) {
+    std::cout << "Verification (" << verifier.getVectors() << " random vectors): LDLt x vs M x "
+              << verifier.getFactorBits() << " bits";
+    if (inverted) {
+        std::cout << ", (Lt x)t L' vs xt " << verifier.getInverseBits() << " bits";
+    }
+    std::cout << "\n";
+}
+
+/**
+ * @brief Says that a run which was meant to be verified (--verify) went through a path that isn't
+ */
+void print_verification_skipped(const char *reason) {
+    if (verify_vectors > 0) {
+        std::cout << "Verification: skipped, " << reason << "\n";
+    }
+}
+
+/**
+ * @brief Exports a matrix or array to the --export prefix (if any) followed by name
+ */
+template <typename Exportable>
+void export_result(const std::string &name, const Exportable &data) {
+    if (!export_target) {
+        return;
+    }
+
+        if (DEBUG) std::cerr << "Exporting " << name << "... ";
+    auto path = export_target->prefix + name + export_extension(export_target->format);
+    if constexpr (std::is_same_v<Exportable, MpMatrix>) {
+        export_matrix(data, path, export_target->format);
+    } else {
+        export_array(data, path, export_target->format);
+    }
+        if (DEBUG) std::cerr << "done!\n";
+}
+
+/**
+ * @brief Moment sequence read in with --moments, used in place of the built-in 2 * (2k + 1)!
+ */
+std::optional<MpArray> input_moments;
+
+/**
+ * @brief Reads the --moments file in at the given shift, into input_moments
+ *
+ * Returns false (having printed why) if the file can't be read or is too short for dim.
+ */
+bool read_moments(const std::string &path, size_t dim, fmpz_shift_t shift) {
+        if (DEBUG) std::cerr << "Reading moments from " << path << "... ";
+    input_moments.emplace(0, shift);
+    try {
+        load_moments(path, shift, *input_moments);
+    } catch (const std::runtime_error &error) {
+        std::cerr << "Error: " << error.what() << "\n";
+        return false;
+    }
+        if (DEBUG) std::cerr << "done!\n";
+
+    if (input_moments->size() < 2 * dim - 1) {
+        std::cerr << "Error: " << path << " has " << input_moments->size()
+                  << " moments, a dimension of " << dim << " needs " << 2 * dim - 1 << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Fills moments with the sequence the source matrix is seeded from, built-in or --moments
+ *
+ * moments must not be longer than 2n - 1 for a dimension n the --moments file was checked for.
+ */
+void fill_moments(MpArray &moments) {
+    if (input_moments) {
+        std::copy(input_moments->begin(), input_moments->begin() + moments.size(), moments.begin());
+    } else {
+        moment_sequence(moments);
+    }
+}
+
+/**
+ * @brief Seeds a (fixedmpz) source matrix, from the --moments sequence if one was given
+ */
+void seed_matrix(MpMatrix &m) {
+    if (input_moments) {
+        hankelInit(m, *input_moments);
+    } else {
+        momentInit(m);
+    }
+}
+
+/**
+ * @brief Where completed factors are kept between runs (see factor_store.hpp), if anywhere
+ *
+ * Set by --factor-store; sequence identifies the moments (built-in or --moments file).
+ */
+struct FactorStoreTarget {
+    std::string directory;
+    uint64_t sequence;
+};
+std::optional<FactorStoreTarget> factor_store;
+
+/**
+ * @brief LDLt-factors a seeded fixedmpz M in place, through the --factor-store if one was given
+ *
+ * A store that can't be read is reported and M factored from scratch; one that can't be written
+ * to is reported once M has been factored.
+ */
+void factor(MpMatrix &m) {
+    std::optional<FactorStore> store;
+    if (factor_store) {
+        try {
+            store.emplace(FactorStore::path_for(factor_store->directory, factor_store->sequence, m.getShift()),
+                          m.getShift());
+        } catch (const std::runtime_error &error) {
+            std::cerr << "Warning: " << error.what() << "; factoring without the store\n";
+        }
+    }
+
+    if (!store) {
+        cholesky_decompose(m, tuning.kronecker);
+        return;
+    }
+
+    try {
+        auto reused = stored_cholesky(m, *store, tuning.kronecker);
+            if (DEBUG) std::cerr << "(" << reused << " of " << store->getRows() << " stored rows reused) ";
+    } catch (const PrecisionExhausted &) {
+        throw;
+    } catch (const std::runtime_error &error) {
+        std::cerr << "Warning: " << error.what() << "; the factor was not stored\n";
+    }
+}
+
 /**
  * @brief Convenience function for printing out a vector-based matrix
  * 
@@ -48,6 +259,67 @@ void print_matrix(std::vector<double> &matrix, size_t dim) {
     std::cout << '\n';
 }
 
+/**
+ * @brief Prints the time and the peak resident set of each phase, next to the size of L if it is
+ * known
+ *
+ * Phase times go on a line of their own, in a fixed format, for scaling.sh to pick up.
+ */
+void print_phases(const PhaseProfile &profile, size_t l_bytes) {
+    auto megabytes = [](size_t bytes) { return double(bytes) / (1024 * 1024); };
+
+    std::cout << "Phase times:" << std::fixed << std::setprecision(6);
+    const char *separator = " ";
+    for (const auto &phase : profile.getPhases()) {
+        std::cout << separator << phase.name << " " << phase.seconds << " s";
+        separator = ", ";
+    }
+
+    std::cout << "\nPeak memory:" << std::setprecision(1);
+    separator = " ";
+    for (const auto &phase : profile.getPhases()) {
+        std::cout << separator << phase.name << " " << megabytes(phase.peak_bytes) << " MB";
+        separator = ", ";
+    }
+    if (l_bytes > 0) {
+        std::cout << " (L takes " << megabytes(l_bytes) << " MB)";
+    }
+    std::cout << std::defaultfloat << std::setprecision(6) << "\n";
+}
+
+/**
+ * @brief Prints the memory budget and warns of every phase that peaked over it
+ */
+void check_budget(const PhaseProfile &profile) {
+    auto megabytes = [](size_t bytes) { return double(bytes) / (1024 * 1024); };
+    auto allowed = memory_budget.allowed();
+    if (allowed == 0) {
+        return;
+    }
+
+    size_t peak = 0;
+    for (const auto &phase : profile.getPhases()) {
+        peak = std::max(peak, phase.peak_bytes);
+    }
+
+    std::cout << "Memory budget: " << std::fixed << std::setprecision(1) << megabytes(allowed) << " MB";
+    if (memory_budget.getLimit() == 0) {
+        std::cout << " (" << MemoryBudget::RATIO << " x the seeded matrix of " << megabytes(memory_budget.getMatrix())
+                  << " MB" << (memory_budget.getTriangles() > 1 ? " and as much for C" : "") << ", plus "
+                  << megabytes(MemoryBudget::SLACK) << " MB)";
+    }
+    std::cout << ", peak " << megabytes(peak) << " MB\n";
+
+    for (const auto &phase : profile.getPhases()) {
+        if (phase.peak_bytes > allowed) {
+            std::cerr << "Warning: " << phase.name << " peaked at " << megabytes(phase.peak_bytes)
+                      << " MB, over the memory budget of " << megabytes(allowed) << " MB\n";
+            over_budget = true;
+        }
+    }
+    std::cout << std::defaultfloat << std::setprecision(6);
+}
+
 /**
  * @brief Main routine for inverting the source matrix
  *
@@ -57,8 +329,8 @@ void print_matrix(std::vector<double> &matrix, size_t dim) {
  * it has all zeros except for the diagonal itself. By default, the input matrix is in
  * column-oriented form such that the cholesky decomposition works. However, because the rest of the
  * operations being performed will be more optimal in row-oriented form, L is reoriented to
- * row-oriented form. From there, L is inverted to get L'. L' is then copied and then transposed to
- * get (Lt)'.
+ * row-oriented form. From there, L is inverted to get L'. (Lt)' is simply L' read the other way,
+ * so it is never stored.
  *
  * Typically by glove's rule, we could get the original matrix's inverse by three matrix
  * multiplications: M'=(Lt)'D'L'. However, since we will really only be interested in the largest
@@ -66,15 +338,34 @@ void print_matrix(std::vector<double> &matrix, size_t dim) {
  * of the inverted matrix. This is also why D is not inverted, as 1/D simply means dividing by D.
  *
  * Input matrix m is changed by this procedure, m_inverse will hold the 10x10 (or otherwised defined
- * size) of the inverse of m. m_inverse should be passed onto the eigensolver.
+ * size) of the inverse of m. m_inverse should be passed onto the eigensolver. The size of the block
+ * computed is taken from m_inverse itself.
+ *
+ * For the floating point types, m is the equilibrated M' = SMS (see moment_exponents()) and the
+ * exponents of S are passed in; the printed diagonal is then scaled back to that of M. Since a
+ * floating point run may turn out not to have enough precision, this gives up right after the
+ * factorization (returning false) if the pivots show that more bits were lost than the type has to
+ * spare.
+ *
+ * If pivots is given, the diagonal D is copied into it.
  */
-void inversion(MpMatrix &m, MpMatrix &m_inverse) {
+template <typename T>
+bool inversion(BasicMpMatrix<T> &m, BasicMpMatrix<T> &m_inverse, const std::vector<long> &exponents = {},
+               BasicMpArray<T> *pivots = nullptr) {
     auto dim = m.getDim();
     auto shift = m.getShift();
+    auto inv_dim = m_inverse.getDim();
+
+    PhaseProfile phases;
+    phases.begin("factor");
 
     // Perform cholesky decomposition on the matrix
         if (DEBUG) std::cerr << "Cholesky-decompose input matrix... ";
-    cholesky_decompose(m);
+    if constexpr (number_traits<T>::fixed_point) {
+        factor(m);
+    } else {
+        cholesky_decompose(m, tuning.kronecker);
+    }
         if (DEBUG) std::cerr << "done!\n";
 
     // All this really does is help me keep the math straight lol
@@ -83,40 +374,507 @@ void inversion(MpMatrix &m, MpMatrix &m_inverse) {
     // Extract diagonals and impose them onto new matrix. Since we're inverting everything we'll
     // invert the diagonal here itself.
         if (DEBUG) std::cerr << "Extracting diagonals... ";
-    MpArray diagonal(dim, shift);
+    BasicMpArray<T> diagonal(dim, shift);
     extract_diagonal(m, diagonal);
+    if (pivots) {
+        *pivots = diagonal;
+    }
         if (DEBUG) std::cerr << "done!\n";
 
-    std::cout << "last diagonal: " << diagonal[diagonal.size() - 1] << std::endl;
+    if constexpr (!number_traits<T>::fixed_point) {
+        auto lost = pivot_bits_lost(diagonal);
+        if (!precision_covers(number_traits<T>::digits, lost)) {
+            if (DEBUG) std::cerr << number_traits<T>::name << " lost " << lost << " bits, promoting\n";
+            return false;
+        }
+
+        auto last = dim - 1;
+        std::cout << "last diagonal: " << scaled_mpf(diagonal[last], -2 * exponents[last]) << std::endl;
+    } else {
+        std::cout << "last diagonal: " << diagonal[diagonal.size() - 1] << std::endl;
+        export_result("diagonal", diagonal);
+        export_result("L", l);
+    }
+
+    // Freivalds-style check, on L now and on L' once it's there (invert() overwrites L)
+    std::optional<FactorVerifier> verifier;
+    if constexpr (number_traits<T>::fixed_point) {
+        if (verify_vectors > 0) {
+            phases.begin("verify-factor");
+                if (DEBUG) std::cerr << "Checking LDLt against M... ";
+            MpArray moments(2 * dim - 1, shift);
+            fill_moments(moments);
+            verifier.emplace(verify_vectors, dim, shift);
+            verifier->check_factor(l, diagonal, moments);
+                if (DEBUG) std::cerr << "done!\n";
+        }
+    }
+
+    size_t l_bytes = 0;
+    if constexpr (number_traits<T>::fixed_point) {
+        l_bytes = limb_bytes(l);
+    }
 
     // We'll take the inverse of L to get L'
+    phases.begin("reorient");
         if (DEBUG) std::cerr << "Transposing L into row-oriented form... ";
     reorient(l);                                            // first get L into row-oriented form
         if (DEBUG) std::cerr << "done!\n";    
+    phases.begin("invert");
         if (DEBUG) std::cerr << "Inverting L to get L'... ";
-    invert(l);      
+    invert(l, tuning.kronecker, inv_dim);
         if (DEBUG) std::cerr << "done!\n";
     auto &l_inverse = l;    // for max clarity, for me
 
-    // Then we'll take the transpose of that to get (Lt)'
-        if (DEBUG) std::cerr << "Transposing L' to get (Lt)'... ";
-    MpMatrix lt_inverse(l);
-    transpose(lt_inverse);
-        if (DEBUG) std::cerr << "done!\n";
+    if constexpr (number_traits<T>::fixed_point) {
+        if (verifier) {
+            phases.begin("verify-inverse");
+                if (DEBUG) std::cerr << "Checking L' against L... ";
+            verifier->check_inverse(l_inverse, inv_dim);
+                if (DEBUG) std::cerr << "done!\n";
+            print_verification(*verifier);
+        }
+    } else {
+        print_verification_skipped("the factorization was in floating point");
+    }
 
-    // Calculate out the first 10x10 (or INV_DIMxINV_DIM) of the inverse of the source matrix
-        if (DEBUG) std::cerr << "Creating first " << INV_DIM << "x" << INV_DIM << " of inverse of M... ";
-    auto zero = 0^fmpzshift(shift);
-    for (size_t i = 0; (i < INV_DIM && i < dim); i++) {
-        for (size_t j = 0; (j < INV_DIM && j < dim); j++) {
-            auto sum = zero;
-            for (size_t k = 0; k < dim; k++) {
-                sum += lt_inverse[i][k] * l_inverse[k][j] / diagonal[k];
+    phases.begin("assemble");
+    if constexpr (number_traits<T>::fixed_point) {
+        // Every term below gets divided by a diagonal entry, so cache their reciprocals. The
+        // dividends are products of two entries out of the first INV_DIM columns of L'.
+            if (DEBUG) std::cerr << "Caching reciprocals of diagonals... ";
+        mp_bitcnt_t entry_bits = 0;
+        for (size_t k = 0; k < dim; k++) {
+            for (size_t j = 0; (j < inv_dim && j < dim); j++) {
+                entry_bits = std::max(entry_bits, mpz_sizeinbase(l_inverse[k][j].get_mpz_t(), 2));
             }
-            m_inverse[i][j] = sum;
+        }
+        std::vector<fixedmpz_reciprocal> reciprocals;
+        invert_diagonal(diagonal, reciprocals, 2 * entry_bits + 1);
+            if (DEBUG) std::cerr << "done!\n";
+
+        // Calculate out the first 10x10 (or INV_DIMxINV_DIM) of the inverse of the source matrix
+            if (DEBUG) std::cerr << "Creating first " << inv_dim << "x" << inv_dim << " of inverse of M... ";
+        assemble_inverse(l_inverse, reciprocals, m_inverse);
+            if (DEBUG) std::cerr << "done!\n";
+    } else {
+            if (DEBUG) std::cerr << "Creating first " << inv_dim << "x" << inv_dim << " of inverse of M... ";
+        std::vector<T> divisors(diagonal.begin(), diagonal.end());
+        assemble_inverse(l_inverse, divisors, m_inverse);
+            if (DEBUG) std::cerr << "done!\n";
+    }
+
+    phases.end();
+    print_phases(phases, l_bytes);
+    check_budget(phases);
+
+    return true;
+}
+
+/**
+ * @brief Runs the whole inversion in a floating point type, leaving the result in m_inverse
+ *
+ * The block of M'^-1 is scaled back to M^-1 and converted into the fixedmpz m_inverse, so that
+ * everything downstream is the same no matter which type did the work. Returns false if the type
+ * turned out not to have enough precision.
+ */
+template <typename T>
+bool floating_inversion(size_t dim, fmpz_shift_t shift, const std::optional<ColumnOwnership> &placement,
+                        MpMatrix &m_inverse) {
+        if (DEBUG) std::cerr << "Generating source matrix in " << number_traits<T>::name << "... ";
+    memory_budget.seeding();
+    BasicMpMatrix<T> m = placement ? BasicMpMatrix<T>(dim, shift, COL_ORIENTED, *placement)
+                                   : BasicMpMatrix<T>(dim, shift, COL_ORIENTED);
+    std::vector<long> exponents;
+    momentInit(m, exponents);
+    memory_budget.seeded();
+    BasicMpMatrix<T> block(m_inverse.getDim(), shift, ROW_ORIENTED);
+        if (DEBUG) std::cerr << "done!\n";
+
+        if (DEBUG) std::cerr << "Finding inverse of source matrix:\n";
+    if (!inversion(m, block, exponents)) {
+        return false;
+    }
+
+    to_fixed_block(block, exponents, m_inverse);
+    return true;
+}
+
+/**
+ * @brief Inverts the moment matrix through its Hankel structure in O(n^2)
+ *
+ * Chebyshev's algorithm turns the moment sequence into the recurrence coefficients of the
+ * orthogonal polynomials, which give D directly and the leading columns of L' with little extra
+ * work. Leaves D in diagonal (whose size sets the dimension) and the leading block of the inverse in
+ * m_inverse, just like inversion() does for the dense path.
+ */
+void structured_inversion(MpArray &diagonal, MpMatrix &m_inverse) {
+    auto dim = diagonal.size();
+    auto shift = diagonal.getShift();
+
+        if (DEBUG) std::cerr << "Generating moment sequence... ";
+    // mu_(2n-1) only feeds alpha_(n-1), which the inverse block never uses, so a sequence of
+    // 2n-1 moments can simply leave it at zero
+    MpArray moments(2 * dim, shift);
+    if (input_moments) {
+        std::copy(input_moments->begin(), input_moments->begin() + 2 * dim - 1, moments.begin());
+    } else {
+        moment_sequence(moments);
+    }
+        if (DEBUG) std::cerr << "done!\n";
+
+    // The same check as the dense path's, on the columns of L as the recurrence goes through them
+    std::optional<FactorVerifier> verifier;
+    if (verify_vectors > 0) {
+        verifier.emplace(verify_vectors, dim, shift);
+    }
+
+        if (DEBUG) std::cerr << "Running Chebyshev algorithm for recurrence coefficients... ";
+    MpArray alpha(dim, shift);
+    MpArray beta(dim, shift);
+    chebyshev_recurrence(moments, alpha, beta, diagonal, PrecisionGuard(), [&](size_t k, const MpArray &sigma) {
+        if (verifier) {
+            verifier->add_sigma_row(k, sigma);
+        }
+    });
+        if (DEBUG) std::cerr << "done!\n";
+
+    std::cout << "last diagonal: " << diagonal[dim - 1] << std::endl;
+    export_result("diagonal", diagonal);
+
+    if (verifier) {
+            if (DEBUG) std::cerr << "Checking LDLt against M... ";
+        verifier->finish_rows(moments);
+            if (DEBUG) std::cerr << "done!\n";
+    }
+
+        if (DEBUG) std::cerr << "Creating first " << m_inverse.getDim() << "x" << m_inverse.getDim() << " of inverse of M... ";
+    std::vector<MpArray> columns;
+    hankel_inverse_block(alpha, beta, diagonal, m_inverse, verifier ? &columns : nullptr);
+        if (DEBUG) std::cerr << "done!\n";
+
+    if (verifier) {
+            if (DEBUG) std::cerr << "Checking L' against L... ";
+        verifier->check_inverse(columns);
+            if (DEBUG) std::cerr << "done!\n";
+        print_verification(*verifier);
+    }
+}
+
+/**
+ * @brief Inverts the moment matrix through a factor at a working shift, refined up to the full one
+ *
+ * The working shift is where the factorization starts (0 for half the full shift) and is
+ * raised as far as the pivots need; see refinement.hpp. Leaves the leading block of the inverse in
+ * m_inverse, at the full shift, like inversion() does.
+ */
+void refined_inversion(size_t dim, fmpz_shift_t shift, fmpz_shift_t working_shift, MpMatrix &m_inverse) {
+        if (DEBUG) std::cerr << "Generating moment sequence... ";
+    MpArray moments(2 * dim - 1, shift);
+    fill_moments(moments);
+        if (DEBUG) std::cerr << "done!\n";
+
+    if (working_shift == 0) {
+        working_shift = shift / 2;
+    }
+    working_shift = std::max<fmpz_shift_t>((working_shift + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS, 1) * GMP_NUMB_BITS;
+
+        if (DEBUG) std::cerr << "Factoring at a working shift and refining first " << m_inverse.getDim() << "x"
+                             << m_inverse.getDim() << " of inverse of M... ";
+    auto report = refine_inverse_block(moments, dim, working_shift, m_inverse, tuning.kronecker);
+        if (DEBUG) std::cerr << "done!\n";
+
+    std::cout << "last diagonal: " << report.last_pivot << std::endl;
+    print_verification_skipped("refinement checks its own residuals");
+    std::cout << "Refinement: working shift " << report.working_shift << " (" << report.factorizations
+              << " factorizations), " << report.iterations << " iterations"
+              << (report.converged ? "" : ", not converged: corrections stalled at 2^"
+                                          + std::to_string(report.stalled_bits) + " ulps") << "\n";
+}
+
+/**
+ * @brief Approximates the smallest eigenvalue of M as 1 / the largest eigenvalue of the leading
+ * inv_dim x inv_dim block of M^-1
+ *
+ * The block is computed in the cheapest arithmetic with enough precision (see arithmetic.hpp),
+ * falling back on fixedmpz through the chosen solver, and then handed to the GSL eigensolver.
+ */
+double block_eigenvalue(size_t dim, fmpz_shift_t shift, size_t inv_dim,
+                        const std::optional<ColumnOwnership> &placement, Arithmetic arithmetic, Solver solver,
+                        fmpz_shift_t working_shift) {
+    MpMatrix m_inverse(std::min<size_t>(inv_dim, dim), shift, ROW_ORIENTED);
+
+    // Try the cheapest arithmetic expected to have enough precision first, moving up to the next
+    // one whenever a run turns out to have lost too many bits
+    bool inverted = false;
+    for (auto type : arithmetic_candidates(arithmetic, dim)) {
+        if (type == Arithmetic::DOUBLE_DOUBLE) {
+            inverted = floating_inversion<double_double>(dim, shift, placement, m_inverse);
+        } else if (type == Arithmetic::QUAD_DOUBLE) {
+            inverted = floating_inversion<quad_double>(dim, shift, placement, m_inverse);
+#ifdef __SIZEOF_FLOAT128__
+        } else if (type == Arithmetic::FLOAT128) {
+            inverted = floating_inversion<__float128>(dim, shift, placement, m_inverse);
+#endif
+        }
+
+        if (inverted) {
+            std::cout << "Arithmetic: " << arithmetic_name(type) << "\n";
+            break;
         }
     }
+
+    if (!inverted && solver == Solver::REFINE) {
+        refined_inversion(dim, shift, working_shift, m_inverse);
+    } else if (!inverted && solver != Solver::STRUCTURED) {
+        MpArray dense_diagonal(dim, shift);
+
+        // Turn away a matrix that won't fit the budget before any of it is allocated
+        MpArray moments(2 * dim - 1, shift);
+        fill_moments(moments);
+        memory_budget.admit(seeded_bytes(moments, dim));
+
+        // Initialize the matrix with the seeding function
+            if (DEBUG) std::cerr << "Generating source matrix... ";
+        memory_budget.seeding();
+        MpMatrix m = placement ? MpMatrix(dim, shift, COL_ORIENTED, *placement)
+                               : MpMatrix(dim, shift, COL_ORIENTED);
+        seed_matrix(m);
+        memory_budget.seeded();
+            if (DEBUG) std::cerr << "done!\n";
+
+        // Invert the source matrix
+            if (DEBUG) std::cerr << "Finding inverse of source matrix:\n";
+        inversion(m, m_inverse, {}, &dense_diagonal);
+
+        if (solver == Solver::CHECK) {
+            // Redo it through the Hankel structure and see how far the two drift apart
+            MpArray diagonal(dim, shift);
+            MpMatrix dense_inverse(m_inverse);
+            structured_inversion(diagonal, m_inverse);
+
+            std::cout << "Structured vs dense: pivots " << deviation_bits(dense_diagonal, diagonal)
+                      << " bits, inverse block " << deviation_bits(dense_inverse, m_inverse) << " bits\n";
+        }
+    } else if (!inverted) {
+        MpArray diagonal(dim, shift);
+        structured_inversion(diagonal, m_inverse);
+    }
+
+    if (!inverted) {
+        std::cout << "Arithmetic: " << arithmetic_name(Arithmetic::FIXED) << "\n";
+    }
+
+    export_result("inverse_block", m_inverse);
+
+    // Extract the largest eigenvalue
+        if (DEBUG) std::cerr << "Extracting largest eigenvalue... ";
+    double inverse_of_largest_eigenvalue = 1.0 / get_eigenvalue(m_inverse, LARGEST);
+        if (DEBUG) std::cerr << "done!\n";
+
+    return inverse_of_largest_eigenvalue;
+}
+
+/**
+ * @brief Checks a factorization that still has D on its diagonal (as factor() leaves it) against M
+ * and prints the outcome, for the paths that never go on to invert L
+ */
+void verify_ldlt(MpMatrix &ldlt) {
+    if (verify_vectors == 0) {
+        return;
+    }
+
+        if (DEBUG) std::cerr << "Checking LDLt against M... ";
+    auto dim = ldlt.getDim();
+    auto shift = ldlt.getShift();
+    MpArray diagonal(dim, shift);
+    extract_diagonal(ldlt, diagonal, false);
+    MpArray moments(2 * dim - 1, shift);
+    fill_moments(moments);
+
+    FactorVerifier verifier(verify_vectors, dim, shift);
+    verifier.check_factor(ldlt, diagonal, moments);
         if (DEBUG) std::cerr << "done!\n";
+
+    print_verification(verifier, false);
+}
+
+/**
+ * @brief Finds the smallest eigenvalue of the full M by inverse iteration, without inverting L
+ *
+ * Only the factorization is done; every iteration is then a pair of O(n^2) triangular solves
+ * against it (see smallest_eigenvalue()). Prints the bound the result is certified to.
+ */
+double iterated_eigenvalue(size_t dim, fmpz_shift_t shift, const std::optional<ColumnOwnership> &placement) {
+        if (DEBUG) std::cerr << "Generating source matrix... ";
+    MpMatrix m = placement ? MpMatrix(dim, shift, COL_ORIENTED, *placement)
+                           : MpMatrix(dim, shift, COL_ORIENTED);
+    seed_matrix(m);
+        if (DEBUG) std::cerr << "done!\n";
+
+        if (DEBUG) std::cerr << "Cholesky-decompose input matrix... ";
+    factor(m);
+        if (DEBUG) std::cerr << "done!\n";
+
+    std::cout << "last diagonal: " << m[dim - 1][dim - 1] << std::endl;
+    export_result("LDLt", m);
+    verify_ldlt(m);
+
+        if (DEBUG) std::cerr << "Inverse iteration for smallest eigenvalue... ";
+    auto estimate = smallest_eigenvalue(m);
+        if (DEBUG) std::cerr << "done!\n";
+
+    std::cout << "Arithmetic: " << arithmetic_name(Arithmetic::FIXED) << "\n";
+    std::cout << "Eigenvalue bound: " << std::setprecision(3) << std::scientific << estimate.bound
+              << " after " << estimate.iterations << " iterations"
+              << (estimate.converged ? "" : " (not converged)") << "\n";
+
+    return estimate.value.get_d();
+}
+
+/**
+ * @brief Brackets the smallest eigenvalue of M to the requested number of digits
+ *
+ * Starts from [0, M[0][0]]: M is positive definite, and the Rayleigh quotient of e_0 bounds the
+ * smallest eigenvalue from above. Every step then factors shifted copies of M (see
+ * bracket_eigenvalue()), so the digits reported are certified rather than inherited from a double
+ * precision eigensolve, provided the shift is enough to factor M itself (which is checked first).
+ */
+double bisected_eigenvalue(size_t dim, fmpz_shift_t shift, const std::optional<ColumnOwnership> &placement,
+                           double digits) {
+        if (DEBUG) std::cerr << "Generating source matrix... ";
+    MpMatrix m = placement ? MpMatrix(dim, shift, COL_ORIENTED, *placement)
+                           : MpMatrix(dim, shift, COL_ORIENTED);
+    seed_matrix(m);
+        if (DEBUG) std::cerr << "done!\n";
+
+    // The shifted factorizations can't tell lost precision from a small pivot, so first check the
+    // shift is enough to factor M itself
+        if (DEBUG) std::cerr << "Checking shift against the pivots of M... ";
+    MpMatrix ldlt(m);
+    factor(ldlt);
+        if (DEBUG) std::cerr << "done!\n";
+    verify_ldlt(ldlt);
+
+        if (DEBUG) std::cerr << "Bisecting on inertia of M - sigma I... ";
+    auto bracket = bracket_eigenvalue(m, 0, 0, m[0][0].to_mpf(), digits);
+        if (DEBUG) std::cerr << "done!\n";
+
+    std::cout << "Arithmetic: " << arithmetic_name(Arithmetic::FIXED) << "\n";
+    std::cout << "Eigenvalue bracket: [" << std::setprecision(int(digits) + 2) << bracket.lower << ", "
+              << bracket.upper << ") after " << bracket.factorizations << " factorizations\n";
+
+    mpf_class middle = (bracket.lower + bracket.upper) / 2;
+    return middle.get_d();
+}
+
+/**
+ * @brief Runs a batch of small dimensions concurrently, one problem per thread
+ *
+ * Every problem goes through the compile-time sized kernels (dense fixedmpz, built-in moments, block
+ * eigenvalue) on a thread of its own, largest first so the long ones don't trail at the end. The
+ * reports are collected and printed in the order the dimensions were given. A problem whose shift
+ * runs out is restarted on its own, or given up on without restart.
+ *
+ * This is the only way into those kernels. What they save is the fork/join of every column, which
+ * only adds up over many problems side by side: a single run of a small dimension is as fast or
+ * faster through the general solvers (which only build the leading columns of L' and can verify
+ * the factor), and goes through them.
+ *
+ * Returns the exit status: 0, or 1 if any problem was given up on.
+ */
+int run_static_batch(const std::vector<size_t> &dims, fmpz_shift_t shift, size_t inv_dim, bool restart) {
+    std::vector<std::string> reports(dims.size());
+    std::vector<size_t> order(dims.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return dims[a] > dims[b]; });
+
+    int status = 0;
+
+    #pragma omp parallel for schedule(dynamic, 1) reduction(max : status)
+    for (size_t p = 0; p < order.size(); p++) {
+        auto index = order[p];
+        auto dim = dims[index];
+        auto m_shift = shift;
+        bool finished = false;
+
+        std::ostringstream out;
+        out << "Size of matrix: " << dim << " by " << dim << "\n";
+        out << "Shift: " << m_shift << "\n";
+
+        auto start_time = std::chrono::high_resolution_clock::now();
+
+        while (!finished) {
+            try {
+                MpArray diagonal(dim, m_shift);
+                MpMatrix m_inverse(std::min(inv_dim, dim), m_shift, ROW_ORIENTED);
+                dispatch_static(dim, [&](auto n) {
+                    static_inversion<decltype(n)::value>(m_shift, nullptr, diagonal, m_inverse);
+                });
+
+                out << "last diagonal: " << diagonal[dim - 1] << "\n";
+                if (verify_vectors > 0) {
+                    out << "Verification: skipped, batches are not checked\n";
+                }
+                out << "Arithmetic: " << arithmetic_name(Arithmetic::FIXED) << "\n";
+                out << "Inverse of largest: " << std::setprecision(15) << std::scientific
+                    << 1.0 / get_eigenvalue(m_inverse, LARGEST) << "\n";
+                finished = true;
+            } catch (const PrecisionExhausted &exhausted) {
+                out << "Precision exhausted: a shift of " << m_shift << " carries dimensions up to "
+                    << exhausted.getSafeDim() << "\n";
+
+                if (!restart) {
+                    status = 1;
+                    break;
+                }
+
+                m_shift = exhausted.getSuggestedShift();
+                out << "Restarting with shift: " << m_shift << "\n";
+            }
+        }
+
+        if (finished) {
+            std::chrono::duration<double> elapsed_time = std::chrono::high_resolution_clock::now() - start_time;
+            out << "Completed in " << elapsed_time.count() << " seconds\n";
+        }
+        reports[index] = out.str();
+    }
+
+    for (auto &report : reports) {
+        std::cout << report << "\n";
+    }
+    return status;
+}
+
+/**
+ * @brief Parses the dimension argument: a single n, or a comma-separated list of n and first-last
+ * ranges; returns false if malformed
+ */
+bool parse_dimensions(const std::string &arg, std::vector<size_t> &dims) {
+    std::istringstream list(arg);
+    std::string item;
+
+    while (std::getline(list, item, ',')) {
+        auto dash = item.find('-');
+        auto first_text = item.substr(0, dash);
+        auto last_text = (dash == std::string::npos) ? first_text : item.substr(dash + 1);
+
+        if (first_text.empty() || last_text.empty()
+                || first_text.find_first_not_of("0123456789") != std::string::npos
+                || last_text.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+
+        size_t first = std::stoul(first_text), last = std::stoul(last_text);
+        if (first == 0 || last < first) {
+            return false;
+        }
+        for (size_t dim = first; dim <= last; dim++) {
+            dims.push_back(dim);
+        }
+    }
+    return !dims.empty();
 }
 
 int main(int argc, char *argv[]) {
@@ -127,35 +885,272 @@ int main(int argc, char *argv[]) {
     // HankelHacker must be launched with 2 extra arguments <dim> and <shift>
     if (argc < 3) {
         std::cerr << "Error: Missing arguments.\n";
-        std::cerr << "Usage: hankelhacker <dimension of source> <shift amount>\n";
+        std::cerr << "Usage: hankelhacker <dimension of source> <shift amount> [options]\n";
+        std::cerr << "       hankelhacker <d1,d2,first-last,...> <shift amount> [--inv-dim=<n>] [--threads=<n>] [--on-exhaustion=<a>]\n";
+        std::cerr << "       (a batch of dimensions up to " << STATIC_MAX_DIM << ", run concurrently, one per thread, through the\n";
+        std::cerr << "       compile-time sized dense fixedmpz kernels; a single dimension takes the general solvers)\n";
+        std::cerr << "Options:\n";
+        std::cerr << "  --inv-dim=<n>    size of the block of the inverse handed to the eigensolver\n";
+        std::cerr << "  --numa[=<block>] pin threads and place each column on its owner's NUMA node\n";
+        std::cerr << "  --arith=<type>   auto (default), dd, f128, qd or fixed\n";
+        std::cerr << "  --solver=<type>  how fixed inverts: structured (default, dense with --numa,\n";
+        std::cerr << "                   --export or --factor-store), dense, check or refine\n";
+        std::cerr << "  --working-shift=<s> shift --solver=refine factors at (default half the shift)\n";
+        std::cerr << "  --eigen=<source> block (default), iterate (inverse iteration on M) or bisect\n";
+        std::cerr << "  --digits=<d>     digits --eigen=bisect brackets the eigenvalue to (default 15)\n";
+        std::cerr << "  --verify=<n>     random vectors to check a fixed factorization with (default 2, 0 for none)\n";
+        std::cerr << "  --export=<path>  export diagonal, L and the inverse block to files starting with path\n";
+        std::cerr << "  --export-format=<f> bin (default, raw limbs), dec or hex (exact text)\n";
+        std::cerr << "  --moments=<file> read the 2n-1 moments from a file instead (binary or text)\n";
+        std::cerr << "  --on-exhaustion=<a> restart (default, at a larger shift) or abort when the shift runs out\n";
+        std::cerr << "  --factor-store=<dir> keep dense factors in dir, and extend stored ones rather than refactor\n";
+        std::cerr << "  --memory-budget=<MB> peak resident set the dense inversion may reach (default "
+                  << MemoryBudget::RATIO << " x the seeded matrix, plus "
+                  << (MemoryBudget::SLACK >> 20) << ")\n";
+        std::cerr << "  --tune           time the thread count, schedule and kernels first and save the best\n";
+        std::cerr << "  --tune-profile=<file> where tuned settings are kept (default ~/.hankelhacker-tuning)\n";
+        std::cerr << "  --threads=<n>    run on n threads, whatever the tuned settings say\n";
         return -1;
     }
 
     // Take command line arguments and store them
-    auto dim = strtoul(argv[1], NULL, 10);
+    std::vector<size_t> dims;
+    if (!parse_dimensions(argv[1], dims)) {
+        std::cerr << "Error: Bad dimension " << argv[1] << "\n";
+        return -1;
+    }
+    auto dim = dims.front();
     fmpz_shift_t m_shift = strtoul(argv[2], NULL, 10);
+    size_t inv_dim = INV_DIM;
+    std::optional<ColumnOwnership> placement;
+    Arithmetic arithmetic = Arithmetic::AUTO;
+    Solver solver = Solver::STRUCTURED;
+    bool solver_given = false;
+    fmpz_shift_t working_shift = 0;
+    EigenSource eigen_mode = EigenSource::BLOCK;
+    double digits = 15;
+    std::string export_prefix;
+    std::string moments_path;
+    std::string store_directory;
+    size_t budget_mb = 0;
+    bool restart = true;
+    bool tune = false;
+    int threads = 0;
+    std::string profile_path = TuningProfile::default_path();
+    ExportFormat export_format = ExportFormat::BINARY;
+
+    for (int arg = 3; arg < argc; arg++) {
+        std::string option(argv[arg]);
+
+        if (option.rfind("--inv-dim=", 0) == 0) {
+            inv_dim = strtoul(option.c_str() + option.find('=') + 1, NULL, 10);
+        } else if (option == "--numa") {
+            placement.emplace();
+        } else if (option.rfind("--numa=", 0) == 0) {
+            placement.emplace(omp_get_max_threads(), strtoul(option.c_str() + 7, NULL, 10));
+        } else if (option.rfind("--arith=", 0) == 0) {
+            if (!parse_arithmetic(option.substr(8), arithmetic)) {
+                std::cerr << "Error: Unknown arithmetic " << option.substr(8) << "\n";
+                return -1;
+            }
+        } else if (option == "--solver=structured") {
+            solver = Solver::STRUCTURED;
+            solver_given = true;
+        } else if (option == "--solver=dense") {
+            solver = Solver::DENSE;
+            solver_given = true;
+        } else if (option == "--solver=check") {
+            solver = Solver::CHECK;
+            solver_given = true;
+        } else if (option == "--solver=refine") {
+            solver = Solver::REFINE;
+            solver_given = true;
+        } else if (option.rfind("--working-shift=", 0) == 0) {
+            working_shift = strtoul(option.c_str() + 16, NULL, 10);
+        } else if (option == "--eigen=block") {
+            eigen_mode = EigenSource::BLOCK;
+        } else if (option == "--eigen=iterate") {
+            eigen_mode = EigenSource::ITERATE;
+        } else if (option == "--eigen=bisect") {
+            eigen_mode = EigenSource::BISECT;
+        } else if (option == "--on-exhaustion=restart") {
+            restart = true;
+        } else if (option == "--on-exhaustion=abort") {
+            restart = false;
+        } else if (option == "--tune") {
+            tune = true;
+        } else if (option.rfind("--threads=", 0) == 0) {
+            threads = atoi(option.c_str() + 10);
+        } else if (option.rfind("--tune-profile=", 0) == 0) {
+            profile_path = option.substr(15);
+        } else if (option.rfind("--factor-store=", 0) == 0) {
+            store_directory = option.substr(15);
+        } else if (option.rfind("--memory-budget=", 0) == 0) {
+            budget_mb = strtoul(option.c_str() + 16, NULL, 10);
+        } else if (option.rfind("--moments=", 0) == 0) {
+            moments_path = option.substr(10);
+        } else if (option.rfind("--export=", 0) == 0) {
+            export_prefix = option.substr(9);
+        } else if (option.rfind("--export-format=", 0) == 0) {
+            if (!parse_export_format(option.substr(16), export_format)) {
+                std::cerr << "Error: Unknown export format " << option.substr(16) << "\n";
+                return -1;
+            }
+        } else if (option.rfind("--verify=", 0) == 0) {
+            verify_vectors = strtoul(option.c_str() + 9, NULL, 10);
+        } else if (option.rfind("--digits=", 0) == 0) {
+            digits = strtod(option.c_str() + 9, NULL);
+        } else {
+            std::cerr << "Error: Unknown option " << option << "\n";
+            return -1;
+        }
+    }
+
+    if (inv_dim == 0) {
+        std::cerr << "Error: --inv-dim must be at least 1\n";
+        return -1;
+    }
+
+    if (!export_prefix.empty()) {
+        export_target = ExportTarget{export_prefix, export_format};
+    }
+
+    if (dims.size() > 1) {
+        if (*std::max_element(dims.begin(), dims.end()) > STATIC_MAX_DIM) {
+            std::cerr << "Error: A batch only takes dimensions up to " << STATIC_MAX_DIM << "\n";
+            return -1;
+        }
+
+        if (placement || export_target || !moments_path.empty() || eigen_mode != EigenSource::BLOCK || tune
+                || !store_directory.empty() || budget_mb > 0
+                || (arithmetic != Arithmetic::AUTO && arithmetic != Arithmetic::FIXED)) {
+            std::cerr << "Error: A batch only takes --inv-dim, --threads and --on-exhaustion\n";
+            return -1;
+        }
+
+        if (threads > 0) {
+            omp_set_num_threads(threads);
+        }
+
+        return run_static_batch(dims, m_shift, inv_dim, restart);
+    }
+
+    // NUMA placement, the export of L and D and the factor store act on the dense factorization,
+    // which neither the structured nor the refining solver builds: without a solver given they
+    // imply the dense one
+    if (eigen_mode == EigenSource::BLOCK && (placement || export_target || !store_directory.empty())
+            && solver != Solver::DENSE && solver != Solver::CHECK) {
+        if (solver_given) {
+            std::cerr << "Error: --numa, --export and --factor-store need --solver=dense or --solver=check\n";
+            return -1;
+        }
+        solver = Solver::DENSE;
+            if (DEBUG) std::cerr << "Solving densely for --numa, --export or --factor-store\n";
+    }
+
+    // Likewise only the fixedmpz factor is exported or stored
+    if ((export_target || !store_directory.empty()) && arithmetic == Arithmetic::AUTO) {
+        arithmetic = Arithmetic::FIXED;
+    }
+
+    if (!store_directory.empty()) {
+        if (placement) {
+            std::cerr << "Error: --factor-store can't be used with --numa\n";
+            return -1;
+        }
+
+        try {
+            factor_store = FactorStoreTarget{store_directory, FactorStore::sequence_hash(moments_path)};
+        } catch (const std::runtime_error &error) {
+            std::cerr << "Error: " << error.what() << "\n";
+            return -1;
+        }
+    }
+
+    memory_budget = MemoryBudget(budget_mb << 20, store_directory.empty() ? 1 : 2);
 
     std::cout << "Size of matrix: " << dim << " by " << dim << "\n";
     std::cout << "Shift: " << m_shift << "\n";
 
+    // Settings tuned on this machine for this (or the nearest) problem size, if any. NUMA placement
+    // fixes its own threads and ownership, so only the defaults apply there.
+    if (!placement) {
+        TuningProfile profile(profile_path);
+        auto cpu = cpu_signature();
+
+        if (tune) {
+                if (DEBUG) std::cerr << "Autotuning on " << cpu << "... ";
+            tuning = autotune(dim, m_shift);
+            profile.record(cpu, dim, m_shift, tuning);
+                if (DEBUG) std::cerr << "done!\n";
+            std::cout << "Tuned: " << describe(tuning) << "\n";
+
+            try {
+                profile.save();
+            } catch (const std::runtime_error &e) {
+                std::cerr << "Warning: " << e.what() << "; tuned settings not saved\n";
+            }
+        } else if (auto tuned = profile.lookup(cpu, dim, m_shift)) {
+            tuning = *tuned;
+        }
+    }
+    if (threads > 0) {
+        tuning.threads = threads;
+    }
+    apply_tuning(tuning);
+        if (DEBUG) std::cerr << "Tuning: " << describe(tuning) << "\n";
+
     // Since time is of interest, note the start time
     auto start_time = std::chrono::high_resolution_clock::now();
 
-    // Initialize the matrix with the seeding function
-        if (DEBUG) std::cerr << "Generating source matrix... ";
-    MpMatrix m(dim, m_shift, COL_ORIENTED);
-    momentInit(m);
-    MpMatrix m_inverse(INV_DIM, m_shift, ROW_ORIENTED);
-        if (DEBUG) std::cerr << "done!\n";
+    // Pin threads before anything is allocated, so first touches land on the right nodes
+    if (placement) {
+        pin_threads(placement->getThreads());
+    }
 
-    // Invert the source matrix
-        if (DEBUG) std::cerr << "Finding inverse of source matrix:\n";
-    inversion(m, m_inverse);
+    if (!moments_path.empty()) {
+        if (!read_moments(moments_path, dim, m_shift)) {
+            return -1;
+        }
 
-    // Extract the largest eigenvalue
-        if (DEBUG) std::cerr << "Extracting largest eigenvalue... ";
-    double inverse_of_largest_eigenvalue = 1.0 / get_eigenvalue(m_inverse, LARGEST);
-        if (DEBUG) std::cerr << "done!\n";
+        // The floating point paths rely on the built-in moments for their equilibration
+        arithmetic = Arithmetic::FIXED;
+    }
+
+    // A shift too small for the dimension is caught at the first pivot it fails on, and the run
+    // either stops there or starts over at the shift the pivots so far suggest it needs
+    double inverse_of_largest_eigenvalue;
+    while (true) {
+        try {
+            if (eigen_mode == EigenSource::ITERATE) {
+                inverse_of_largest_eigenvalue = iterated_eigenvalue(dim, m_shift, placement);
+            } else if (eigen_mode == EigenSource::BISECT) {
+                inverse_of_largest_eigenvalue = bisected_eigenvalue(dim, m_shift, placement, digits);
+            } else {
+                inverse_of_largest_eigenvalue = block_eigenvalue(dim, m_shift, inv_dim, placement, arithmetic, solver,
+                                                                 working_shift);
+            }
+            break;
+        } catch (const MemoryBudgetExceeded &exceeded) {
+            std::cerr << "Error: " << exceeded.what() << "\n";
+            return -1;
+        } catch (const PrecisionExhausted &exhausted) {
+                if (DEBUG) std::cerr << "\n";
+            std::cout << "Precision exhausted: a shift of " << m_shift << " carries dimensions up to "
+                      << exhausted.getSafeDim() << "\n";
+
+            if (!restart) {
+                return 1;
+            }
+
+            m_shift = exhausted.getSuggestedShift();
+            std::cout << "Restarting with shift: " << m_shift << "\n";
+
+            if (!moments_path.empty() && !read_moments(moments_path, dim, m_shift)) {
+                return -1;
+            }
+        }
+    }
 
     std::cout << "Inverse of largest: " << std::setprecision(15) <<  std::scientific
               << inverse_of_largest_eigenvalue << '\n';
@@ -165,5 +1160,11 @@ int main(int argc, char *argv[]) {
     std::chrono::duration<double> elapsed_time = finish_time - start_time;
     std::cout << "Completed in " << elapsed_time.count() << " seconds\n";
 
+    // A budget that was asked for is a hard one
+    if (over_budget && memory_budget.getLimit() > 0) {
+        std::cerr << "Error: The run went over its --memory-budget\n";
+        return 2;
+    }
+
     return 0;
 }
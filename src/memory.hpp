@@ -0,0 +1,203 @@
+/**
+ * @brief Peak resident memory of the phases of a run
+ *
+ * The matrix is what bounds the dimensions a node can take, so the peak matters more than the
+ * total. The kernel keeps the high-water mark of a process's resident set (VmHWM in
+ * /proc/self/status), and writing 5 to /proc/self/clear_refs resets it to the current resident
+ * set, so the peak of each phase can be read off on its own. Where /proc isn't there (or can't be
+ * written to), the peaks read 0, or run on across phases.
+ *
+ * A MemoryBudget puts a bound on those peaks in terms of the seeded matrix, and says which phases
+ * went over it.
+ *
+ * @file memory.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <gmpxx.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "mpmatrix.hpp"
+
+namespace momentmp {
+    namespace memory_detail {
+        /// A "kB" field out of /proc/self/status, in bytes (0 if it isn't there)
+        inline size_t status_bytes(const std::string &field) {
+            std::ifstream status("/proc/self/status");
+            std::string line;
+            while (std::getline(status, line)) {
+                if (line.compare(0, field.size(), field) == 0) {
+                    std::istringstream value(line.substr(field.size()));
+                    size_t kb = 0;
+                    value >> kb;
+                    return kb * 1024;
+                }
+            }
+            return 0;
+        }
+    }
+
+    /**
+     * @brief Resident set size of the process right now, in bytes
+     */
+    inline size_t resident_bytes() {
+        return memory_detail::status_bytes("VmRSS:");
+    }
+
+    /**
+     * @brief Largest resident set size since the last reset_peak_resident() (or since startup)
+     */
+    inline size_t peak_resident_bytes() {
+        return memory_detail::status_bytes("VmHWM:");
+    }
+
+    /**
+     * @brief Hands memory that was freed back to the system, where the C library allows
+     */
+    inline void release_free_memory() {
+#ifdef __GLIBC__
+        malloc_trim(0);
+#endif
+    }
+
+    /**
+     * @brief Starts the peak resident set over from the current one; false if that can't be done
+     *
+     * Memory freed since is handed back to the system first, so that what one phase freed doesn't
+     * count towards the next.
+     */
+    inline bool reset_peak_resident() {
+        release_free_memory();
+        std::ofstream clear("/proc/self/clear_refs");
+        clear << "5";
+        clear.flush();
+        return bool(clear);
+    }
+
+    /**
+     * @brief Bytes allocated for the limbs of the numbers in a fixedmpz matrix
+     *
+     * The size of the matrix as far as its numbers go, to put the peaks in proportion.
+     */
+    inline size_t limb_bytes(const MpMatrix &matrix) {
+        size_t limbs = 0;
+        for (const auto &line : matrix) {
+            for (const auto &entry : line) {
+                limbs += size_t(entry.get_mpz_t()->_mp_alloc);
+            }
+        }
+        return limbs * sizeof(mp_limb_t);
+    }
+
+    /**
+     * @brief Bytes a fixedmpz matrix seeded from moments (M[i][j] = moments[i + j]) will take
+     *
+     * Counts the limbs of the lower triangle, each block rounded up the way glibc's allocator does,
+     * and the fixedmpz of every entry; an estimate of what seeding adds to the resident set, taken
+     * before anything is allocated.
+     */
+    inline size_t seeded_bytes(const MpArray &moments, size_t dim) {
+        size_t bytes = dim * dim * sizeof(fixedmpz);
+        for (size_t sum = 0; sum + 1 < 2 * dim && sum < moments.size(); sum++) {
+            // entries (row, col) with row + col = sum and col <= row < dim
+            size_t first = sum >= dim ? sum - dim + 1 : 0;
+            size_t entries = sum / 2 + 1 - first;
+            size_t limbs = std::max<size_t>(mpz_size(moments[sum].get_mpz_t()), 1);
+            bytes += entries * ((limbs * sizeof(mp_limb_t) + sizeof(size_t) + 15) / 16 * 16);
+        }
+        return bytes;
+    }
+
+    /**
+     * @brief Thrown when a run would need more memory than the --memory-budget it was given
+     */
+    class MemoryBudgetExceeded : public std::runtime_error {
+      public:
+        using std::runtime_error::runtime_error;
+    };
+
+    /**
+     * @brief The resident set a dense inversion is allowed to peak at
+     *
+     * The budget is RATIO times what seeding the matrix added to the resident set, on top of what
+     * the process held before: the factorization works in place, and the inversion frees L as it
+     * goes, so no phase needs more than the matrix and a few columns' worth besides. SLACK more is
+     * allowed for what doesn't grow with the matrix (thread stacks, allocator arenas, the block of
+     * the inverse), which would otherwise sink the budget of a small one. A run that keeps a second
+     * triangle alongside (the factor store's C) is allowed twice the matrix.
+     *
+     * Given a limit in bytes, the budget is that limit instead, and a run estimated not to fit in
+     * it (see seeded_bytes()) is turned away before it allocates anything.
+     */
+    class MemoryBudget {
+      private:
+        size_t limit;
+        size_t triangles;
+        size_t baseline = 0;
+        size_t matrix = 0;
+
+      public:
+        static constexpr double RATIO = 1.1;
+        static constexpr size_t SLACK = size_t(4) << 20;
+
+        explicit MemoryBudget(size_t limit = 0, size_t triangles = 1) : limit(limit), triangles(triangles) {}
+
+        /**
+         * @brief Throws MemoryBudgetExceeded if a matrix of the estimated size can't fit the limit
+         */
+        void admit(size_t estimate) const {
+            auto needed = resident_bytes() + size_t(RATIO * this->triangles * estimate) + SLACK;
+            if (this->limit > 0 && needed > this->limit) {
+                throw MemoryBudgetExceeded("The matrix needs about " + std::to_string(needed >> 20)
+                                           + " MB, over the memory budget of " + std::to_string(this->limit >> 20)
+                                           + " MB");
+            }
+        }
+
+        /// Notes the resident set just before the matrix is seeded, less whatever was freed before
+        /// (a run restarted at a larger shift has just freed a whole matrix)
+        void seeding() {
+            release_free_memory();
+            this->baseline = resident_bytes();
+        }
+
+        /// Notes what seeding the matrix added to the resident set
+        void seeded() {
+            auto now = resident_bytes();
+            this->matrix = now > this->baseline ? now - this->baseline : 0;
+        }
+
+        size_t getMatrix() const {
+            return this->matrix;
+        }
+
+        size_t getLimit() const {
+            return this->limit;
+        }
+
+        size_t getTriangles() const {
+            return this->triangles;
+        }
+
+        /// The peak resident set allowed, 0 if it couldn't be measured
+        size_t allowed() const {
+            if (this->limit > 0) {
+                return this->limit;
+            }
+            if (this->matrix == 0) {
+                return 0;
+            }
+            return this->baseline + size_t(RATIO * this->triangles * this->matrix) + SLACK;
+        }
+    };
+}
@@ -7,10 +7,20 @@
 
 #pragma once
 
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
 #include <omp.h>
 
 #include "fixedmpz.hpp"
+#include "kronecker.hpp"
 #include "mpmatrix.hpp"
+#include "number_traits.hpp"
+#include "parallel_mul.hpp"
+#include "precision.hpp"
+#include "triangular.hpp"
 
 namespace momentmp {
     /**
@@ -33,49 +43,271 @@ namespace momentmp {
      * @brief Initialize an MpMatrix with the moment seeding function (per the focus of the project)
      */
     inline void momentInit(MpMatrix &matrix) {
+        // Placed matrices get each column seeded (and its limbs allocated) by its owner
+        if (auto &owners = matrix.getOwnership()) {
+            #pragma omp parallel num_threads(owners->getThreads())
+            owners->for_owned(0, matrix.getDim(), [&](size_t col) {
+                momentInitCol(matrix[col]);
+            });
+            return;
+        }
+
         #pragma omp parallel for schedule(dynamic, 1)
         for (auto it = matrix.begin(); it < matrix.end(); it++) {
             momentInitCol(*it);
         }
     }
 
+    /**
+     * @brief Power-of-two equilibration exponents e_i for the moment matrix
+     *
+     * The moments outgrow the exponent range of double-based types very quickly, so the floating
+     * point types work on M' = SMS with S = diag(2^e_i), which has a diagonal of roughly 1. Being
+     * powers of two, the scaling itself is exact, and M^-1 = S M'^-1 S.
+     */
+    inline std::vector<long> moment_exponents(size_t dim) {
+        std::vector<long> exponents(dim);
+
+        for (size_t i = 0; i < dim; i++) {
+            // M_ii = 2 * (4i + 1)!
+            auto diagonal = factorial(4 * i + 1);
+            long bits = mpz_sizeinbase(diagonal.get_mpz_t(), 2) + 1;
+            exponents[i] = -(bits / 2);
+        }
+
+        return exponents;
+    }
+
+    /**
+     * @brief Initializes a column of the equilibrated moment matrix M' = SMS in a floating type
+     */
+    template <typename T>
+    inline void momentInitCol(BasicMpArray<T> &col, const std::vector<long> &exponents) {
+        const auto size = col.size();
+        const auto i = col.getId();
+
+        for (size_t index = i; index < size; index++) {
+            mpf_class moment(0, number_traits<T>::digits + 64);
+            mpf_set_z(moment.get_mpf_t(), factorial((2 * (i + index)) + 1).get_mpz_t());
+            col[index] = number_traits<T>::from_mpf(moment, exponents[i] + exponents[index] + 1);
+        }
+    }
+
+    /**
+     * @brief Initialize a floating point matrix with the equilibrated moment matrix M' = SMS
+     *
+     * @param[out] exponents the exponents of S, as from moment_exponents()
+     */
+    template <typename T>
+    inline void momentInit(BasicMpMatrix<T> &matrix, std::vector<long> &exponents) {
+        exponents = moment_exponents(matrix.getDim());
+
+        if (auto &owners = matrix.getOwnership()) {
+            #pragma omp parallel num_threads(owners->getThreads())
+            owners->for_owned(0, matrix.getDim(), [&](size_t col) {
+                momentInitCol(matrix[col], exponents);
+            });
+            return;
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (auto it = matrix.begin(); it < matrix.end(); it++) {
+            momentInitCol(*it, exponents);
+        }
+    }
+
+    /**
+     * @brief Kronecker-substitution path for the trailing update of one cholesky_decompose() step
+     *
+     * Batches the rank-1 update one tile of columns at a time. Returns false, having done nothing,
+     * if the policy says the element-wise path should be used instead.
+     */
+    inline bool kronecker_cholesky_update(MpMatrix &matrix, const MpArray &quotients, const MpArray &column,
+                                          size_t start, const KroneckerPolicy &policy) {
+        auto dim = matrix.getDim();
+        auto shift = matrix.getShift();
+        const size_t tile = policy.tile;
+
+        auto limbs = !policy.enabled ? 0 : std::max(
+            max_limbs(dim - start, [&](size_t r) -> const mpz_class & { return quotients[start + r](); }),
+            max_limbs(dim - start, [&](size_t r) -> const mpz_class & { return column[start + r](); }));
+
+        if (!use_kronecker(tile * (dim - start), limbs, policy)) {
+            return false;
+        }
+
+        #pragma omp parallel for schedule(runtime)
+        for (size_t first = start; first < dim; first += tile) {
+            auto cols = std::min(tile, dim - first);
+            mpz_class scaled;
+
+            // rows [first, dim) cover the lower part of every column in the tile
+            kronecker_tile(dim - first, cols, 1,
+                [&](size_t r, size_t) -> const mpz_class & { return quotients[first + r](); },
+                [&](size_t, size_t c) -> const mpz_class & { return column[first + c](); },
+                [&](size_t r, size_t c, const mpz_class &yx) {
+                    if (r < c) {
+                        return;
+                    }
+                    mpz_fdiv_q_2exp(scaled.get_mpz_t(), yx.get_mpz_t(), shift);
+                    matrix[first + c][first + r]() -= scaled;
+                });
+        }
+
+        return true;
+    }
+
     /**
      * @brief Performs a cholesky decomposition on the input matrix
      *
      * Matrix will be transformed into a lower triangular form such that M=LDLt. However, this
      * function returns L with D superimposed onto it. To separate them, extract_diagonal() should be
      * used.
+     *
+     * For fixedmpz, the trailing update of each step is a rank-1 update, which is batched through
+     * Kronecker substitution (see kronecker_cholesky_update()) whenever the policy deems it
+     * profitable. Both paths truncate each product the same way, so they give bit-identical results
+     * (except where an operand is below 2^-66, when mul_high() can land an ulp off the exact floor).
+     * Towards the end, at very high shifts, too few columns remain to go around the threads, and
+     * the columns are then updated one at a time with each product split across the threads.
+     *
+     * If the matrix was placed under a ColumnOwnership map, every column is divided and updated by
+     * the thread owning it (element-wise), so its limbs never leave that thread's NUMA node.
+     *
+     * For fixedmpz, each pivot is checked against the fixed-point resolution before it is used (see
+     * precision.hpp), and PrecisionExhausted is thrown at the first one with too few bits left
+     * rather than carrying on with garbage. The guard can be switched off where small or negative
+     * pivots are expected, as for the inertia of a shifted matrix.
+     *
+     * @param steps number of columns to eliminate; stopping short of dim leaves the trailing block
+     *              holding the Schur complement of the leading one (autotune.hpp times its probes
+     *              this way)
+     * @param undivided if given, receives every column as it was just before being divided by its
+     *                  pivot, i.e. LD (factor_store.hpp keeps these)
      */
-    inline void cholesky_decompose(MpMatrix &matrix) {
+    template <typename T>
+    inline void cholesky_decompose(BasicMpMatrix<T> &matrix, const KroneckerPolicy &policy = KroneckerPolicy(),
+                                   const PrecisionGuard &guard = PrecisionGuard(), size_t steps = SIZE_MAX,
+                                   BasicMpMatrix<T> *undivided = nullptr) {
         auto dim = matrix.getDim();
 
+        // Sizes of the diagonal before anything is cancelled off it, to measure the pivots against
+        std::vector<size_t> diagonal_bits;
+        if constexpr (number_traits<T>::fixed_point) {
+            if (guard.enabled) {
+                for (auto &col : matrix) {
+                    diagonal_bits.push_back(mpz_sizeinbase(col[col.getId()].get_mpz_t(), 2));
+                }
+            }
+        }
+
         // procCol is the column currently being applied to every other column
         for (auto &procCol : matrix) {
             auto id = procCol.getId();
             auto start = id + 1;
-            MpArray orig(procCol);
+            if (id >= steps) {
+                break;
+            }
+            if (undivided) {
+                (*undivided)[id] = procCol;
+            }
 
-            // Replace procCol with all the values under diagonal with those values divided by
-            // diagonal
-            auto &diagonal = orig[id];
-            for (size_t row = start; row < dim; row++) {
-                procCol[row] /= diagonal;
+            if constexpr (number_traits<T>::fixed_point) {
+                if (guard.enabled) {
+                    check_pivot(guard, procCol[id], diagonal_bits[id], id, dim);
+                }
             }
 
-            // Apply procCol to all other columns to its right
-            #pragma omp parallel for schedule(dynamic, 1)
-            for (size_t col = start; col < dim; col++) {
-                MpArray &destCol = matrix[col];
+            // The update of the columns to the right needs the column both as it is and divided by
+            // its pivot, so the quotients are built apart from it rather than over a copy of it. They
+            // take the place of the undivided values once the update is done, and the values go.
+            BasicMpArray<T> quotients(dim, procCol.getShift(), id);
+
+            // Fill quotients with all the values under diagonal divided by diagonal. For fixedmpz
+            // the divisor is the same all the way down, so take its reciprocal once and multiply
+            // by that instead.
+            auto divide_column = [&]() {
+                if (start >= dim) {
+                    return;
+                }
+
+                if constexpr (number_traits<T>::fixed_point) {
+                    mp_bitcnt_t precision = 0;
+                    for (size_t row = start; row < dim; row++) {
+                        precision = std::max(precision, mpz_sizeinbase(procCol[row].get_mpz_t(), 2));
+                    }
+
+                    // Each quotient is worked out in scratch and then set into storage of its own
+                    // size, so the column is final with no room left over from the division
+                    fixedmpz_reciprocal diagonal(procCol[id], precision);
+                    mpz_class scratch;
+                    for (size_t row = start; row < dim; row++) {
+                        diagonal.divide(scratch, procCol[row]());
+                        quotients[row]() = scratch;
+                    }
+                    procCol[id].shrink_to_fit();
+                } else {
+                    const auto &diagonal = procCol[id];
+                    for (size_t row = start; row < dim; row++) {
+                        quotients[row] = procCol[row] / diagonal;
+                    }
+                }
+            };
+
+            auto update_column = [&](size_t col) {
+                BasicMpArray<T> &destCol = matrix[col];
 
                 // Going down the rows for each col, z' = z - yx
                 for (size_t row = col; row < dim; row++) {
                     auto &z = destCol[row];
-                    const auto &y = orig[col];
-                    const auto &x = procCol[row];
+                    const auto &y = procCol[col];
+                    const auto &x = quotients[row];
+
+                    z -= y * x;
+                }
+            };
+
+            // The undivided values leave with quotients at the end of the step
+            auto finish_column = [&]() {
+                for (size_t row = start; row < dim; row++) {
+                    std::swap(procCol[row], quotients[row]);
+                }
+            };
+
+            if (auto &owners = matrix.getOwnership()) {
+                #pragma omp parallel num_threads(owners->getThreads())
+                {
+                    if (owners->owns(id)) {
+                        divide_column();
+                    }
+
+                    #pragma omp barrier
+                    owners->for_owned(start, dim, update_column);
+
+                    #pragma omp barrier
+                    if (owners->owns(id)) {
+                        finish_column();
+                    }
+                }
+                continue;
+            }
+
+            divide_column();
+
+            // Apply the column to all other columns to its right
+            bool batched = false;
+            if constexpr (number_traits<T>::fixed_point) {
+                batched = kronecker_cholesky_update(matrix, quotients, procCol, start, policy);
+            }
 
-                    z = z - (y * x);
+            if (!batched) {
+                #pragma omp parallel for schedule(runtime) if (inter_element<T>(dim - start, matrix.getShift()))
+                for (size_t col = start; col < dim; col++) {
+                    update_column(col);
                 }
             }
+
+            finish_column();
         }
     }
 
@@ -84,13 +316,13 @@ namespace momentmp {
      *
      * The replacement functionality can be switched off by making repalce=false
      */
-    inline void extract_diagonal(MpMatrix &src, MpArray &dest, bool replace=true) {
+    template <typename T>
+    inline void extract_diagonal(BasicMpMatrix<T> &src, BasicMpArray<T> &dest, bool replace=true) {
         if (dest.size() != src.getDim()) {
             throw std::runtime_error("Cannot extract to different size array");
         }
 
-        auto shift = fmpzshift(src.getShift());
-        auto one = (1^shift);
+        auto one = number_traits<T>::one(src.getShift());
 
         for (auto &proc : src) {
             auto id = proc.getId();
@@ -105,7 +337,8 @@ namespace momentmp {
     /**
      * @brief Take an MpArray of diagonals and superimpose it onto an MpMatrix
      */
-    inline void impose_diagonal(MpArray &diagonal, MpMatrix &dest) {
+    template <typename T>
+    inline void impose_diagonal(BasicMpArray<T> &diagonal, BasicMpMatrix<T> &dest) {
         if (diagonal.size() != dest.getDim()) {
             throw std::runtime_error("Cannot impose diagonal on different dimension matrix");
         }
@@ -117,28 +350,122 @@ namespace momentmp {
     }
 
     /**
-     * @brief Inverts an MpMatrix via Gaussian-Elimination
+     * @brief Kronecker-substitution path for one elimination step of invert()
+     *
+     * Batches the rank-1 update of the rows below procRow one tile of rows at a time, over the
+     * columns up to id only (the rest of procRow being zero), or the first columns only if fewer are
+     * wanted. Returns false, having done nothing, if the policy says the element-wise path should be
+     * used instead.
+     */
+    inline bool kronecker_invert_update(MpMatrix &matrix, const MpArray &procRow, size_t columns,
+                                        const KroneckerPolicy &policy) {
+        auto dim = matrix.getDim();
+        auto shift = matrix.getShift();
+        auto id = procRow.getId();
+        auto width = std::min(id + 1, columns);
+        const size_t tile = policy.tile;
+
+        auto limbs = !policy.enabled ? 0 : std::max(
+            max_limbs(width, [&](size_t i) -> const mpz_class & { return procRow[i](); }),
+            max_limbs(dim - id - 1, [&](size_t r) -> const mpz_class & { return matrix[id + 1 + r][id](); }));
+
+        if (!use_kronecker(tile * width, limbs, policy)) {
+            return false;
+        }
+
+        #pragma omp parallel for schedule(runtime)
+        for (size_t first = id + 1; first < dim; first += tile) {
+            auto rows = std::min(tile, dim - first);
+            mpz_class scaled;
+
+            kronecker_tile(rows, width, 1,
+                [&](size_t r, size_t) -> const mpz_class & { return matrix[first + r][id](); },
+                [&](size_t, size_t i) -> const mpz_class & { return procRow[i](); },
+                [&](size_t r, size_t i, const mpz_class &product) {
+                    if (i == id) {
+                        return;
+                    }
+                    mpz_fdiv_q_2exp(scaled.get_mpz_t(), product.get_mpz_t(), shift);
+                    matrix[first + r][i]() -= scaled;
+                });
+
+            for (size_t r = 0; r < rows; r++) {
+                auto &destRow = matrix[first + r];
+                if (id < columns) {
+                    destRow[id] = -destRow[id];
+                } else {
+                    destRow[id] = fixedmpz(0, shift);
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * @brief Inverts a unit lower triangular MpMatrix (row-oriented) in place by Gauss elimination
+     *
+     * L X = I is solved with L^-1 built up in place of L itself, not in an identity matrix of its
+     * own: both stay lower triangular, so every step only touches the columns up to procRow's id.
+     * For fixedmpz, each elimination step is a rank-1 update of the rows below procRow, which is
+     * batched through Kronecker substitution (see kronecker_invert_update()) whenever the policy
+     * deems it profitable. As in cholesky_decompose(), the last few steps at very high shifts split
+     * each product across the threads rather than handing out rows.
+     *
+     * If the matrix was placed under a ColumnOwnership map, every row is updated by the thread
+     * owning it (element-wise). Having been transposed by its owner, row i sits in the storage
+     * column i had, so this is the same thread that owned column i during the factorization.
+     *
+     * Column j of L^-1 only ever takes in column j of L^-1 and the entries of L, so if only the
+     * first few columns are wanted (all assemble_inverse() reads), the rest are never computed: the
+     * steps past them cost O(n * columns) instead of O(n^2). Each entry of L in those columns is
+     * freed as soon as its step has read it, so the matrix shrinks down to those columns as the
+     * elimination goes on. Which of the entries are worked out, and how, doesn't change.
+     *
+     * @param columns leading columns of L^-1 to compute; below the diagonal, the rest are left zero
      */
-    inline void invert(MpMatrix &matrix) {
+    template <typename T>
+    inline void invert(BasicMpMatrix<T> &matrix, const KroneckerPolicy &policy = KroneckerPolicy(),
+                       size_t columns = SIZE_MAX) {
         auto dim = matrix.getDim();
+        auto zero = number_traits<T>::zero(matrix.getShift());
 
         // procRow is the row currently being applied to all other rows
         for (auto &procRow : matrix) {
             auto id = procRow.getId();
             auto start = id + 1;
 
-            #pragma omp parallel for schedule(dynamic, 1)
-            for (size_t row = start; row < dim; row++) {
+            auto update_row = [&](size_t row) {
                 auto &destRow = matrix[row];
                 auto scale = destRow[id];
 
-                for (size_t i = 0; i < dim; i++) {
+                for (size_t i = 0; i < start && i < columns; i++) {
                     if (i == id) {
                         destRow[i] = -destRow[i];
                     } else {
-                        destRow[i] = destRow[i] - (procRow[i] * scale);
+                        destRow[i] -= procRow[i] * scale;
                     }
                 }
+                if (id >= columns) {
+                    destRow[id] = T(zero);
+                }
+            };
+
+            if (auto &owners = matrix.getOwnership()) {
+                #pragma omp parallel num_threads(owners->getThreads())
+                owners->for_owned(start, dim, update_row);
+                continue;
+            }
+
+            if constexpr (number_traits<T>::fixed_point) {
+                if (kronecker_invert_update(matrix, procRow, columns, policy)) {
+                    continue;
+                }
+            }
+
+            #pragma omp parallel for schedule(runtime) if (inter_element<T>(dim - start, matrix.getShift()))
+            for (size_t row = start; row < dim; row++) {
+                update_row(row);
             }
         }
     }
@@ -146,12 +473,45 @@ namespace momentmp {
     /**
      * @brief Inverts an MpArray of diagonals by doing 1/element for each element
      */
-    inline void invert_diagonal(MpArray &diagonal) {
-        auto shift = fmpzshift(diagonal.getShift());
-        auto one = 1^shift;
+    template <typename T>
+    inline void invert_diagonal(BasicMpArray<T> &diagonal) {
+        auto one = number_traits<T>::one(diagonal.getShift());
 
         for (auto &elem : diagonal) {
             elem = one / elem;
         }
     }
-}
\ No newline at end of file
+
+    /**
+     * @brief Caches a reciprocal of each diagonal entry, so that later divisions by them are multiplies
+     *
+     * @param precision largest dividend size (in bits) the reciprocals should handle by multiplication
+     */
+    inline void invert_diagonal(const MpArray &diagonal, std::vector<fixedmpz_reciprocal> &dest,
+                                mp_bitcnt_t precision) {
+        dest.clear();
+        dest.reserve(diagonal.size());
+
+        for (auto &elem : diagonal) {
+            dest.emplace_back(elem, precision);
+        }
+    }
+
+    /**
+     * @brief Builds the leading block of M' = (Lt)'D'L' out of L' and the diagonal
+     *
+     * The diagonal can be given as anything L's elements can be divided by: the cached
+     * fixedmpz_reciprocal of each entry for fixedmpz, or simply the entries themselves.
+     *
+     * This is syrk() of the lower triangular L' with D' applied by division, so (Lt)' is read out
+     * of L' rather than stored, and entry (i, j) only sums over k >= max(i, j). The block is
+     * dest.getDim() on a side (capped at the dimension of L'), and bit-identical however many
+     * threads run it.
+     */
+    template <typename T, typename Divisor>
+    inline void assemble_inverse(const BasicMpMatrix<T> &l_inverse, const std::vector<Divisor> &diagonal,
+                                 BasicMpMatrix<T> &dest, size_t chunk = 64) {
+        syrk(l_inverse, Transpose::YES, [&](const T &product, size_t k) { return product / diagonal[k]; },
+             dest, chunk);
+    }
+}
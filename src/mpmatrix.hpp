@@ -10,13 +10,19 @@
 
 #pragma once
 
+#include <cmath>
 #include <iostream>
+#include <optional>
+#include <utility>
 #include <vector>
 
 #include <gmpxx.h>
 #include <omp.h>
 
 #include "fixedmpz.hpp"
+#include "kronecker.hpp"
+#include "number_traits.hpp"
+#include "numa.hpp"
 
 /**
  * @brief Namespace for the Multiple Precision Matrix Project
@@ -29,21 +35,29 @@ namespace momentmp {
     using fmpz_shift_t = fmpz_shift_t;   ///< alias to the scaling type really used for fixedmpz
 
     /**
-     * @brief MpArray is a wrapper for a vector of fixedmpz numbers
+     * @brief BasicMpArray is a wrapper for a vector of numbers (fixedmpz unless otherwise chosen)
+     *
+     * The element type can be any type with number_traits; MpArray is the fixedmpz one used
+     * throughout the project.
      */
-    class MpArray {
+    template <typename T>
+    class BasicMpArray {
       private:
-        std::vector<fmp_t> col;
+        std::vector<T> col;
         size_t dim, id;
         fmpz_shift_t shift;
       public:
-        MpArray(size_t dim, fmpz_shift_t shift, size_t id=-1) noexcept
+        using value_type = T;
+
+        BasicMpArray(size_t dim, fmpz_shift_t shift, size_t id=-1) noexcept
                 : dim(dim), id(id), shift(shift) {
-            this->col = std::vector<fmp_t>(dim, fmp_t(0, shift));
+            this->col = std::vector<T>(dim, number_traits<T>::zero(shift));
         }
 
-        MpArray(const MpArray &other) = default;
-        MpArray(MpArray &&other) = default;
+        BasicMpArray(const BasicMpArray &other) = default;
+        BasicMpArray(BasicMpArray &&other) = default;
+        BasicMpArray &operator=(const BasicMpArray &other) = default;
+        BasicMpArray &operator=(BasicMpArray &&other) = default;
 
         size_t getId() {
             return this->id;
@@ -98,15 +112,15 @@ namespace momentmp {
         /**
          * @brief Exposes the underlying vector's [] operator to access elements inside the MpArray
          */
-        fmp_t &operator[](size_t row) {
+        T &operator[](size_t row) {
             return this->col[row];
         }
 
         /**
          * @brief Exposes the underlying vector's [] operator to access elements inside the MpArray
          */
-        fmp_t &operator[](size_t row) const {
-            return const_cast<fmp_t&>(this->col[row]);
+        T &operator[](size_t row) const {
+            return const_cast<T&>(this->col[row]);
         }
 
         /**
@@ -163,15 +177,19 @@ namespace momentmp {
             return this->col.cend();
         }
 
-        friend std::ostream &operator<<(std::ostream &os, MpArray &array);
+        template <typename U>
+        friend std::ostream &operator<<(std::ostream &os, BasicMpArray<U> &array);
     };
 
+    using MpArray = BasicMpArray<fmp_t>; ///< the fixedmpz array used throughout the project
+
     /**
      * @brief Operator overload for having an MpArray be printed out using std::ostream
      *
      * Example usage : <code>std::cout << array;<\code>
      */
-    inline std::ostream &operator<<(std::ostream &os, MpArray &array) {
+    template <typename T>
+    inline std::ostream &operator<<(std::ostream &os, BasicMpArray<T> &array) {
         for (auto &e : array) {
             os << e << ' ';
         }
@@ -195,15 +213,24 @@ namespace momentmp {
      * elements in the underlying container to be accessed using a reasonable syntax (i.e.,
      * <code>name_of_matrix[row][col]</code> (if row-oriented) or
      * <code>name_of_matrix[col][row]</code>(if col-oriented)).
+     *
+     * Like BasicMpArray, the element type can be any type with number_traits; MpMatrix is the
+     * fixedmpz one.
      */
-    class MpMatrix {
+    template <typename T>
+    class BasicMpMatrix {
       private:
+        using MpArray = BasicMpArray<T>;
+
         std::vector<MpArray> matrix;
         size_t dim;         ///< dimension * dimension = rows [we're working with square matricies]
         fmpz_shift_t shift;  ///< for keeping track of the shift/precision factor across the matrix
         MpMatrixMode mode;
+        std::optional<ColumnOwnership> ownership; ///< set if columns were placed per-thread (NUMA)
       public:
-        MpMatrix(size_t dim, fmpz_shift_t shift, MpMatrixMode mode = COL_ORIENTED) noexcept
+        using value_type = T;
+
+        BasicMpMatrix(size_t dim, fmpz_shift_t shift, MpMatrixMode mode = COL_ORIENTED) noexcept
                 : dim(dim),  shift(shift) {
             this->matrix = std::vector<MpArray>(dim, MpArray(dim, shift, 0));
             for (size_t i = 0; i < dim; i++) {
@@ -212,8 +239,26 @@ namespace momentmp {
             this->mode = mode;
         }
 
-        MpMatrix(const MpMatrix &other) = default;
-        MpMatrix(MpMatrix &&other) = default;
+        /**
+         * @brief Constructs an MpMatrix whose columns are each allocated by the thread owning them
+         *
+         * Every column (its element storage and the limbs of its numbers) is allocated and first
+         * touched by its owner under the given map, so with pinned threads it lands on the owner's
+         * NUMA node. The map is kept with the matrix; momentInit(), cholesky_decompose(), invert()
+         * and transpose() then have each column (or row) worked on by that same owner.
+         */
+        BasicMpMatrix(size_t dim, fmpz_shift_t shift, MpMatrixMode mode, const ColumnOwnership &ownership) noexcept
+                : dim(dim), shift(shift), mode(mode), ownership(ownership) {
+            this->matrix = std::vector<MpArray>(dim, MpArray(0, shift, 0));
+
+            #pragma omp parallel num_threads(ownership.getThreads())
+            ownership.for_owned(0, dim, [&](size_t i) {
+                this->matrix[i] = MpArray(dim, shift, i);
+            });
+        }
+
+        BasicMpMatrix(const BasicMpMatrix &other) = default;
+        BasicMpMatrix(BasicMpMatrix &&other) = default;
 
         /**
          * @brief Return the size of the MpArray.
@@ -251,6 +296,13 @@ namespace momentmp {
             return this->shift;
         }
 
+        /**
+         * @brief Return the ownership map the columns were placed under, if any
+         */
+        const std::optional<ColumnOwnership> &getOwnership() const {
+            return this->ownership;
+        }
+
         /**
          * @brief Return the orientation mode currently set for the MpMatrix
          */
@@ -340,7 +392,7 @@ namespace momentmp {
         }
 
         void clear() {
-            auto zero = 0^fmpzshift(this->getShift());
+            auto zero = number_traits<T>::zero(this->getShift());
             for (auto &array : *this) {
                 for (auto &elem : array) {
                     elem = zero;
@@ -348,26 +400,45 @@ namespace momentmp {
             }
         }
 
-        void dumpVecDouble(std::vector<double> &dest) const {
+        /**
+         * @brief Copies the matrix into dest as doubles, line by line, each scaled by 2^-scale
+         *
+         * A fixedmpz entry is read straight off its top limbs, and the scale applied to its exponent
+         * before it is made a double, so that entries beyond the range of a double still make it
+         * across given a scale near their own exponent. Lines are converted in parallel once there
+         * are enough entries to make up for starting the threads.
+         */
+        void dumpVecDouble(std::vector<double> &dest, long scale = 0) const {
             auto dim = this->getDim();
 
+            #pragma omp parallel for schedule(static) if (dim * dim >= 4096)
             for (size_t i = 0; i < dim; i++) {
                 for (size_t j = 0; j < dim; j++) {
                     auto &elem = matrix[i][j];
-                    dest[i * dim + j] = elem.to_mpf().get_d();
+                    if constexpr (number_traits<T>::fixed_point) {
+                        long exponent;
+                        double d = elem.get_d_2exp(exponent);
+                        dest[i * dim + j] = std::ldexp(d, int(exponent - scale));
+                    } else {
+                        dest[i * dim + j] = std::ldexp(number_traits<T>::to_double(elem), int(-scale));
+                    }
                 }
             }
         }
 
-        friend std::ostream &operator<<(std::ostream &os, const MpMatrix &mp);
+        template <typename U>
+        friend std::ostream &operator<<(std::ostream &os, const BasicMpMatrix<U> &mp);
     };
 
+    using MpMatrix = BasicMpMatrix<fmp_t>; ///< the fixedmpz matrix used throughout the project
+
     /**
      * @brief Operator overload for having an MpMatrix be printed out using std::ostream
      *
      * Example usage : <code>std::cout << matrix;<\code>
      */
-    inline std::ostream &operator<<(std::ostream &os, const MpMatrix &mp) {
+    template <typename T>
+    inline std::ostream &operator<<(std::ostream &os, const BasicMpMatrix<T> &mp) {
         std::ios::fmtflags initialFlags(os.flags());
 
         auto mode = mp.getMode();
@@ -393,12 +464,61 @@ namespace momentmp {
         return os;
     }
 
+    /**
+     * @brief Kronecker-substitution path of multiply(), for fixedmpz matrices
+     *
+     * The product is built up tile by tile (and depth chunk by depth chunk). Returns false, having
+     * done nothing, if the policy says the element-wise path should be used instead.
+     */
+    inline bool kronecker_multiply(const MpMatrix &multiplicand, const MpMatrix &multiplier,
+                                   MpMatrix &product, const KroneckerPolicy &policy) {
+        auto dim = multiplicand.getDim();
+        auto shift = product.getShift();
+        const size_t tile = policy.tile;
+
+        size_t limbs = 0;
+        for (size_t i = 0; policy.enabled && i < dim; i++) {
+            limbs = std::max(limbs, max_limbs(dim, [&](size_t k) -> const mpz_class & { return multiplicand[i][k](); }));
+            limbs = std::max(limbs, max_limbs(dim, [&](size_t k) -> const mpz_class & { return multiplier[i][k](); }));
+        }
+
+        if (!use_kronecker(tile * tile * std::min(tile, dim), limbs, policy)) {
+            return false;
+        }
+
+        #pragma omp parallel for collapse(2) schedule(dynamic, 1)
+        for (size_t i0 = 0; i0 < dim; i0 += tile) {
+            for (size_t j0 = 0; j0 < dim; j0 += tile) {
+                auto rows = std::min(tile, dim - i0);
+                auto cols = std::min(tile, dim - j0);
+                mpz_class scaled;
+
+                for (size_t k0 = 0; k0 < dim; k0 += tile) {
+                    kronecker_tile(rows, cols, std::min(tile, dim - k0),
+                        [&](size_t i, size_t k) -> const mpz_class & { return multiplicand[i0 + i][k0 + k](); },
+                        [&](size_t k, size_t j) -> const mpz_class & { return multiplier[k0 + k][j0 + j](); },
+                        [&](size_t i, size_t j, const mpz_class &sum) {
+                            mpz_fdiv_q_2exp(scaled.get_mpz_t(), sum.get_mpz_t(), shift);
+                            product[i0 + i][j0 + j]() += scaled;
+                        });
+                }
+            }
+        }
+
+        return true;
+    }
+
     /**
      * @brief This function multiplies together two MpMatrix objects.
      *
-     * Nothing particularly fancy, just schoolhouse multiplication.
+     * Nothing particularly fancy, just schoolhouse multiplication. For larger fixedmpz matrices of
+     * modest precision, the product is instead built up with Kronecker substitution (see
+     * kronecker_multiply()). That path truncates once per chunk rather than once per product, so
+     * its result can differ from the schoolhouse one in the last few bits.
      */
-    inline void multiply(const MpMatrix &multiplicand, const MpMatrix &multiplier, MpMatrix &product) {
+    template <typename T>
+    inline void multiply(const BasicMpMatrix<T> &multiplicand, const BasicMpMatrix<T> &multiplier,
+                         BasicMpMatrix<T> &product, const KroneckerPolicy &policy = KroneckerPolicy()) {
         if (multiplicand.getDim() != multiplier.getDim()) {
             throw std::runtime_error("Unable to multiply MpMatricies of different dimensions");
         }
@@ -407,6 +527,12 @@ namespace momentmp {
             throw std::runtime_error("Destination (Product) matrix must be of same dimension as factors");
         }
 
+        if constexpr (number_traits<T>::fixed_point) {
+            if (kronecker_multiply(multiplicand, multiplier, product, policy)) {
+                return;
+            }
+        }
+
         auto dim = multiplicand.getDim();
         for (size_t i = 0; i < dim; i++) {
             for (size_t j = 0; j < dim; j++) {
@@ -421,16 +547,35 @@ namespace momentmp {
      * @brief Performs an in-place transpose of an MpMatrix
      *
      * per https://en.wikipedia.org/wiki/In-place_matrix_transposition#Square_matrices
+     *
+     * Entries are swapped, so nothing is allocated and the peak memory stays that of the matrix.
+     * Copying them instead would leave the storage of every moved entry allocated twice over, since
+     * setting a number to 0 doesn't give its limbs back.
      */
-    inline void transpose(MpMatrix &matrix) {
+    template <typename T>
+    inline void transpose(BasicMpMatrix<T> &matrix) {
         auto dim = matrix.getDim();
 
+        // Under an ownership map, values are copied rather than swapped, so storage stays where
+        // it is. The big entries of a triangular matrix all move into the container with the larger
+        // index, so have that container's owner do the copying (and any reallocating); the
+        // originals are moved out and freed as soon as they are copied.
+        if (auto &owners = matrix.getOwnership()) {
+            #pragma omp parallel num_threads(owners->getThreads())
+            owners->for_owned(1, dim, [&](size_t m) {
+                for (size_t n = 0; n < m; n++) {
+                    auto temp = std::move(matrix[m][n]);
+                    matrix[m][n] = matrix[n][m];
+                    matrix[n][m] = std::move(temp);
+                }
+            });
+            return;
+        }
+
         #pragma omp parallel for schedule(dynamic, 1)
         for (size_t n = 0; n < (dim - 1); n++) {
             for (size_t m = (n + 1); m < dim; m++) {
-                auto temp = matrix[m][n];
-                matrix[m][n] = matrix[n][m];
-                matrix[n][m] = temp;
+                std::swap(matrix[m][n], matrix[n][m]);
             }
         }
     }
@@ -440,7 +585,8 @@ namespace momentmp {
      *
      * per https://en.wikipedia.org/wiki/In-place_matrix_transposition#Square_matrices
      */
-    inline void reorient(MpMatrix &matrix) {
+    template <typename T>
+    inline void reorient(BasicMpMatrix<T> &matrix) {
         transpose(matrix);
 
         auto mode = matrix.getMode();
@@ -456,7 +602,8 @@ namespace momentmp {
      *
      * Perhaps useful for symmetrical matrices
      */
-    inline void reflect(MpMatrix &matrix) {
+    template <typename T>
+    inline void reflect(BasicMpMatrix<T> &matrix) {
         auto dim = matrix.getDim();
 
         for (size_t n = 0; n < (dim - 1); n++) {
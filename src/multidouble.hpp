@@ -0,0 +1,303 @@
+/**
+ * @brief Double-double and quad-double floating point types
+ *
+ * Unevaluated sums of two (or four) doubles, giving roughly 106 (or 212) bits of significand at a
+ * small multiple of the cost of hardware doubles. The algorithms are the standard error-free
+ * transformations from Hida, Li and Bailey's QD library ("sloppy" variants of add and multiply,
+ * which are accurate to a few ulps of the full width). Only what the matrix kernels need is here:
+ * the four basic operations, negation and comparisons.
+ *
+ * @file multidouble.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <cmath>
+
+namespace momentmp {
+    namespace multidouble_detail {
+        /// s + err = a + b exactly, given |a| >= |b|
+        inline double quick_two_sum(double a, double b, double &err) {
+            double s = a + b;
+            err = b - (s - a);
+            return s;
+        }
+
+        /// s + err = a + b exactly
+        inline double two_sum(double a, double b, double &err) {
+            double s = a + b;
+            double bb = s - a;
+            err = (a - (s - bb)) + (b - bb);
+            return s;
+        }
+
+        /// p + err = a * b exactly
+        inline double two_prod(double a, double b, double &err) {
+            double p = a * b;
+            err = std::fma(a, b, -p);
+            return p;
+        }
+
+        /// a + b + c = a' + b' + c', with a' the leading term
+        inline void three_sum(double &a, double &b, double &c) {
+            double t1, t2, t3;
+            t1 = two_sum(a, b, t2);
+            a = two_sum(c, t1, t3);
+            b = two_sum(t2, t3, c);
+        }
+
+        /// a + b + c ~ a' + b', dropping the lowest order error
+        inline void three_sum2(double &a, double &b, double &c) {
+            double t1, t2, t3;
+            t1 = two_sum(a, b, t2);
+            a = two_sum(c, t1, t3);
+            b = t2 + t3;
+        }
+
+        /// Renormalizes five overlapping components into four non-overlapping ones
+        inline void renorm(double &c0, double &c1, double &c2, double &c3, double &c4) {
+            if (std::isinf(c0)) {
+                return;
+            }
+
+            double s0, s1, s2 = 0.0, s3 = 0.0;
+
+            s0 = quick_two_sum(c3, c4, c4);
+            s0 = quick_two_sum(c2, s0, c3);
+            s0 = quick_two_sum(c1, s0, c2);
+            c0 = quick_two_sum(c0, s0, c1);
+
+            s0 = c0;
+            s1 = c1;
+
+            if (s1 != 0.0) {
+                s1 = quick_two_sum(s1, c2, s2);
+                if (s2 != 0.0) {
+                    s2 = quick_two_sum(s2, c3, s3);
+                    if (s3 != 0.0) {
+                        s3 += c4;
+                    } else {
+                        s2 = quick_two_sum(s2, c4, s3);
+                    }
+                } else {
+                    s1 = quick_two_sum(s1, c3, s2);
+                    if (s2 != 0.0) {
+                        s2 = quick_two_sum(s2, c4, s3);
+                    } else {
+                        s1 = quick_two_sum(s1, c4, s2);
+                    }
+                }
+            } else {
+                s0 = quick_two_sum(s0, c2, s1);
+                if (s1 != 0.0) {
+                    s1 = quick_two_sum(s1, c3, s2);
+                    if (s2 != 0.0) {
+                        s2 = quick_two_sum(s2, c4, s3);
+                    } else {
+                        s1 = quick_two_sum(s1, c4, s2);
+                    }
+                } else {
+                    s0 = quick_two_sum(s0, c3, s1);
+                    if (s1 != 0.0) {
+                        s1 = quick_two_sum(s1, c4, s2);
+                    } else {
+                        s0 = quick_two_sum(s0, c4, s1);
+                    }
+                }
+            }
+
+            c0 = s0;
+            c1 = s1;
+            c2 = s2;
+            c3 = s3;
+        }
+
+        inline void renorm(double &c0, double &c1, double &c2, double &c3) {
+            double c4 = 0.0;
+            renorm(c0, c1, c2, c3, c4);
+        }
+    }
+
+    /**
+     * @brief Double-double number: hi + lo with |lo| <= ulp(hi) / 2, about 106 bits of significand
+     */
+    class double_double {
+      public:
+        double hi, lo;
+
+        constexpr double_double(double hi = 0.0, double lo = 0.0) noexcept : hi(hi), lo(lo) {}
+
+        double_double &operator+=(const double_double &b) {
+            using namespace multidouble_detail;
+            double s1, s2, t1, t2;
+            s1 = two_sum(this->hi, b.hi, s2);
+            t1 = two_sum(this->lo, b.lo, t2);
+            s2 += t1;
+            s1 = quick_two_sum(s1, s2, s2);
+            s2 += t2;
+            this->hi = quick_two_sum(s1, s2, this->lo);
+            return *this;
+        }
+
+        double_double &operator-=(const double_double &b) {
+            return *this += -b;
+        }
+
+        double_double &operator*=(const double_double &b) {
+            using namespace multidouble_detail;
+            double p1, p2;
+            p1 = two_prod(this->hi, b.hi, p2);
+            p2 += (this->hi * b.lo + this->lo * b.hi);
+            this->hi = quick_two_sum(p1, p2, this->lo);
+            return *this;
+        }
+
+        double_double &operator/=(const double_double &b) {
+            // long division: q1 + q2 + q3, each from the remainder of the previous
+            double q1 = this->hi / b.hi;
+            double_double r = *this - b * double_double(q1);
+            double q2 = r.hi / b.hi;
+            r -= b * double_double(q2);
+            double q3 = r.hi / b.hi;
+
+            double lo;
+            double hi = multidouble_detail::quick_two_sum(q1, q2, lo);
+            double_double q(hi, lo);
+            q += double_double(q3);
+            return *this = q;
+        }
+
+        double_double operator-() const {
+            return double_double(-this->hi, -this->lo);
+        }
+
+        friend double_double operator+(double_double a, const double_double &b) { return a += b; }
+        friend double_double operator-(double_double a, const double_double &b) { return a -= b; }
+        friend double_double operator*(double_double a, const double_double &b) { return a *= b; }
+        friend double_double operator/(double_double a, const double_double &b) { return a /= b; }
+
+        friend bool operator<(const double_double &a, const double_double &b) {
+            return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+        }
+        friend bool operator>(const double_double &a, const double_double &b) { return b < a; }
+        friend bool operator==(const double_double &a, const double_double &b) {
+            return a.hi == b.hi && a.lo == b.lo;
+        }
+    };
+
+    /**
+     * @brief Quad-double number: four non-overlapping doubles, about 212 bits of significand
+     */
+    class quad_double {
+      public:
+        double x[4];
+
+        constexpr quad_double(double x0 = 0.0, double x1 = 0.0, double x2 = 0.0, double x3 = 0.0) noexcept
+                : x{x0, x1, x2, x3} {}
+
+        quad_double &operator+=(const quad_double &b) {
+            using namespace multidouble_detail;
+            double s0, s1, s2, s3, t0, t1, t2, t3;
+
+            s0 = two_sum(this->x[0], b.x[0], t0);
+            s1 = two_sum(this->x[1], b.x[1], t1);
+            s2 = two_sum(this->x[2], b.x[2], t2);
+            s3 = two_sum(this->x[3], b.x[3], t3);
+
+            s1 = two_sum(s1, t0, t0);
+            three_sum(s2, t0, t1);
+            three_sum2(s3, t0, t2);
+            t0 = t0 + t1 + t3;
+
+            renorm(s0, s1, s2, s3, t0);
+            this->x[0] = s0;
+            this->x[1] = s1;
+            this->x[2] = s2;
+            this->x[3] = s3;
+            return *this;
+        }
+
+        quad_double &operator-=(const quad_double &b) {
+            return *this += -b;
+        }
+
+        quad_double &operator*=(const quad_double &b) {
+            using namespace multidouble_detail;
+            const double *a = this->x;
+            double p0, p1, p2, p3, p4, p5;
+            double q0, q1, q2, q3, q4, q5;
+            double t0, t1, s0, s1, s2;
+
+            p0 = two_prod(a[0], b.x[0], q0);
+            p1 = two_prod(a[0], b.x[1], q1);
+            p2 = two_prod(a[1], b.x[0], q2);
+            p3 = two_prod(a[0], b.x[2], q3);
+            p4 = two_prod(a[1], b.x[1], q4);
+            p5 = two_prod(a[2], b.x[0], q5);
+
+            three_sum(p1, p2, q0);
+            three_sum(p2, q1, q2);
+            three_sum(p3, p4, p5);
+
+            s0 = two_sum(p2, p3, t0);
+            s1 = two_sum(q1, p4, t1);
+            s2 = q2 + p5;
+            s1 = two_sum(s1, t0, t0);
+            s2 += (t0 + t1);
+
+            s1 += a[0] * b.x[3] + a[1] * b.x[2] + a[2] * b.x[1] + a[3] * b.x[0]
+                    + q0 + q3 + q4 + q5;
+
+            renorm(p0, p1, s0, s1, s2);
+            this->x[0] = p0;
+            this->x[1] = p1;
+            this->x[2] = s0;
+            this->x[3] = s1;
+            return *this;
+        }
+
+        quad_double &operator/=(const quad_double &b) {
+            // long division, one double of quotient per round
+            double q0, q1, q2, q3;
+            quad_double r;
+
+            q0 = this->x[0] / b.x[0];
+            r = *this - b * quad_double(q0);
+            q1 = r.x[0] / b.x[0];
+            r -= b * quad_double(q1);
+            q2 = r.x[0] / b.x[0];
+            r -= b * quad_double(q2);
+            q3 = r.x[0] / b.x[0];
+
+            multidouble_detail::renorm(q0, q1, q2, q3);
+            this->x[0] = q0;
+            this->x[1] = q1;
+            this->x[2] = q2;
+            this->x[3] = q3;
+            return *this;
+        }
+
+        quad_double operator-() const {
+            return quad_double(-this->x[0], -this->x[1], -this->x[2], -this->x[3]);
+        }
+
+        friend quad_double operator+(quad_double a, const quad_double &b) { return a += b; }
+        friend quad_double operator-(quad_double a, const quad_double &b) { return a -= b; }
+        friend quad_double operator*(quad_double a, const quad_double &b) { return a *= b; }
+        friend quad_double operator/(quad_double a, const quad_double &b) { return a /= b; }
+
+        friend bool operator<(const quad_double &a, const quad_double &b) {
+            for (int i = 0; i < 4; i++) {
+                if (a.x[i] != b.x[i]) {
+                    return a.x[i] < b.x[i];
+                }
+            }
+            return false;
+        }
+        friend bool operator>(const quad_double &a, const quad_double &b) { return b < a; }
+        friend bool operator==(const quad_double &a, const quad_double &b) {
+            return !(a < b) && !(b < a);
+        }
+    };
+}
@@ -0,0 +1,130 @@
+/**
+ * @brief NUMA-aware ownership of MpMatrix columns and thread pinning
+ *
+ * On multi-socket machines the limbs of every number should live on the node of the thread that
+ * works on them. Rather than calling into a NUMA library, this leans on first-touch placement:
+ * threads are pinned to fixed CPUs, and each column is allocated, initialized and updated only by
+ * the thread that owns it under a static block-cyclic map. Since GMP allocates through malloc, a
+ * column's limbs then come out of (and get first touched by) its owner, on its owner's node.
+ *
+ * @file numa.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include <omp.h>
+#include <sched.h>
+
+namespace momentmp {
+    /**
+     * @brief Static block-cyclic map from column (or row) index to the OpenMP thread that owns it
+     *
+     * Blocks of <code>block</code> consecutive indices are dealt out to threads round-robin. The
+     * same map has to be used for allocating a matrix and for every pass over it, which is why
+     * MpMatrix carries the map it was allocated under.
+     */
+    class ColumnOwnership {
+      private:
+        int threads;
+        size_t block;
+
+      public:
+        ColumnOwnership(int threads = omp_get_max_threads(), size_t block = 4) noexcept
+                : threads(std::max(threads, 1)), block(std::max<size_t>(block, 1)) {}
+
+        /// Number of threads the columns are spread across
+        int getThreads() const {
+            return this->threads;
+        }
+
+        /// Number of consecutive indices handed to a thread at a time
+        size_t getBlock() const {
+            return this->block;
+        }
+
+        /// Returns the thread that owns the index
+        int owner(size_t index) const {
+            return static_cast<int>((index / this->block) % this->threads);
+        }
+
+        /**
+         * @brief Whether the calling thread is the one for_owned() visits the index on
+         *
+         * Unlike owner(), this goes by the team actually running, so it agrees with for_owned()
+         * when the runtime hands out fewer than getThreads() threads.
+         */
+        bool owns(size_t index) const {
+            const size_t team = omp_get_num_threads();
+            return (index / this->block) % team == size_t(omp_get_thread_num());
+        }
+
+        /**
+         * @brief Calls fn(index) for every index in [first, last) owned by the calling thread
+         *
+         * Must be called by every thread of a parallel region of getThreads() threads. Should the
+         * runtime hand out a smaller team, the blocks are dealt out over the actual team instead,
+         * so that every index still gets visited exactly once.
+         */
+        template <typename Fn>
+        void for_owned(size_t first, size_t last, Fn &&fn) const {
+            const size_t me = omp_get_thread_num();
+            const size_t team = omp_get_num_threads();
+
+            for (size_t b = first / this->block; b * this->block < last; b++) {
+                if (b % team != me) {
+                    continue;
+                }
+
+                auto end = std::min(last, (b + 1) * this->block);
+                for (size_t index = std::max(first, b * this->block); index < end; index++) {
+                    fn(index);
+                }
+            }
+        }
+    };
+
+    /**
+     * @brief Pins every OpenMP thread to a CPU of its own, so thread numbers map to fixed nodes
+     *
+     * Threads are laid over the CPUs this process is allowed on in order, so neighbouring thread
+     * numbers share a socket. Dynamic team sizing is switched off so that parallel regions get the
+     * full team the ownership map expects. If the OpenMP runtime is already binding threads (e.g.
+     * OMP_PROC_BIND is set), its binding is left alone.
+     */
+    inline void pin_threads(int threads) {
+        omp_set_dynamic(0);
+
+        if (omp_get_proc_bind() != omp_proc_bind_false) {
+            return;
+        }
+
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return;
+        }
+
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+
+        if (cpus.empty()) {
+            return;
+        }
+
+        #pragma omp parallel num_threads(threads)
+        {
+            cpu_set_t mine;
+            CPU_ZERO(&mine);
+            CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &mine);
+            sched_setaffinity(0, sizeof(mine), &mine);
+        }
+    }
+}
@@ -0,0 +1,170 @@
+/**
+ * @brief Traits describing the number types the matrix containers and kernels can be built on
+ *
+ * The kernels in moment_algorithm.hpp are written once and instantiated over fixedmpz (arbitrary
+ * precision fixed-point) as well as over the much cheaper floating point types double_double,
+ * quad_double and (where the compiler has it) __float128. Anything that differs between them
+ * (what zero and one look like, how to convert to and from mpf_class, how many bits of
+ * significand they carry) goes through number_traits.
+ *
+ * @file number_traits.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <iostream>
+#include <type_traits>
+
+#include <gmpxx.h>
+
+#include "fixedmpz.hpp"
+#include "multidouble.hpp"
+
+namespace momentmp {
+    /**
+     * @brief Per-type details needed by the generic matrix containers and kernels
+     *
+     * <code>fixed_point</code> is true only for fixedmpz; kernels use it to switch on the
+     * fixedmpz-only machinery (reciprocals, Kronecker tiles). <code>digits</code> is the number of
+     * significand bits a floating type carries (0 for fixedmpz, whose precision is set by its
+     * shift).
+     */
+    template <typename T>
+    struct number_traits;
+
+    template <>
+    struct number_traits<fixedmpz> {
+        static constexpr bool fixed_point = true;
+        static constexpr unsigned digits = 0;
+        static constexpr const char *name = "fixedmpz";
+
+        static fixedmpz zero(fmpz_shift_t shift) {
+            return fixedmpz(0, shift);
+        }
+
+        static fixedmpz one(fmpz_shift_t shift) {
+            return 1^fmpzshift(shift);
+        }
+
+        static mpf_class to_mpf(const fixedmpz &x) {
+            return x.to_mpf();
+        }
+
+        static double to_double(const fixedmpz &x) {
+            return x.get_d();
+        }
+    };
+
+    /**
+     * @brief Shared traits of the floating types built out of doubles (or __float128)
+     *
+     * Conversions go through successive double-sized pieces of an mpf_class, which is exact as long
+     * as the mpf has at least as many bits as the type being converted to.
+     */
+    template <typename T, unsigned Bits>
+    struct float_traits {
+        static constexpr bool fixed_point = false;
+        static constexpr unsigned digits = Bits;
+
+        static T zero(fmpz_shift_t) {
+            return T(0.0);
+        }
+
+        static T one(fmpz_shift_t) {
+            return T(1.0);
+        }
+
+        /// x * 2^exp, with the double pieces split off the top of x one at a time
+        static T from_mpf(const mpf_class &x, long exp = 0) {
+            mpf_class rest(x, Bits + 64);
+            if (exp >= 0) {
+                mpf_mul_2exp(rest.get_mpf_t(), rest.get_mpf_t(), exp);
+            } else {
+                mpf_div_2exp(rest.get_mpf_t(), rest.get_mpf_t(), -exp);
+            }
+
+            T result(0.0);
+            for (unsigned piece = 0; piece * 53 < Bits + 53; piece++) {
+                double d = rest.get_d();
+                if (d == 0.0) {
+                    break;
+                }
+                result += T(d);
+                rest -= d;
+            }
+            return result;
+        }
+    };
+
+    template <>
+    struct number_traits<double_double> : float_traits<double_double, 106> {
+        static constexpr const char *name = "double-double";
+
+        static mpf_class to_mpf(const double_double &x) {
+            mpf_class ret(x.hi, 128);
+            ret += x.lo;
+            return ret;
+        }
+
+        static double to_double(const double_double &x) {
+            return x.hi + x.lo;
+        }
+    };
+
+    template <>
+    struct number_traits<quad_double> : float_traits<quad_double, 212> {
+        static constexpr const char *name = "quad-double";
+
+        static mpf_class to_mpf(const quad_double &x) {
+            mpf_class ret(x.x[0], 256);
+            for (int i = 1; i < 4; i++) {
+                ret += x.x[i];
+            }
+            return ret;
+        }
+
+        static double to_double(const quad_double &x) {
+            return x.x[0] + x.x[1];
+        }
+    };
+
+    inline std::ostream &operator<<(std::ostream &os, const double_double &x) {
+        return os << number_traits<double_double>::to_mpf(x);
+    }
+
+    inline std::ostream &operator<<(std::ostream &os, const quad_double &x) {
+        return os << number_traits<quad_double>::to_mpf(x);
+    }
+
+#ifdef __SIZEOF_FLOAT128__
+    /// Whether __float128 is available as an element type
+    constexpr bool has_float128 = true;
+
+    template <>
+    struct number_traits<__float128> : float_traits<__float128, 113> {
+        static constexpr const char *name = "__float128";
+
+        static mpf_class to_mpf(const __float128 &x) {
+            double hi = static_cast<double>(x);
+            double mid = static_cast<double>(x - hi);
+            double lo = static_cast<double>(x - hi - mid);
+
+            mpf_class ret(hi, 192);
+            ret += mid;
+            ret += lo;
+            return ret;
+        }
+
+        static double to_double(const __float128 &x) {
+            return static_cast<double>(x);
+        }
+    };
+
+    inline std::ostream &operator<<(std::ostream &os, const __float128 &x) {
+        return os << number_traits<__float128>::to_mpf(x);
+    }
+#else
+    constexpr bool has_float128 = false;
+#endif
+}
@@ -0,0 +1,157 @@
+/**
+ * @brief Multiplication of single huge numbers spread across threads
+ *
+ * At very high shifts a single product takes milliseconds, while at small dimensions the element
+ * loops of the kernels have fewer iterations than there are cores. Rather than leave those cores
+ * idle, the top levels of a Karatsuba split are run as OpenMP tasks: each level turns one product
+ * into three of half the size, which GMP then finishes off with its own Toom/FFT code. The result
+ * is exact, so it is bit-identical to a plain mpz_mul.
+ *
+ * @file parallel_mul.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+
+#include <gmpxx.h>
+#include <omp.h>
+
+namespace momentmp {
+    /**
+     * @brief Knobs for when products are split across threads
+     */
+    struct IntraPolicy {
+        size_t min_limbs = 1024;    ///< smaller operands are multiplied on one thread
+    };
+
+    /**
+     * @brief How a kernel loop should use its threads
+     *
+     * INTER_ELEMENT runs the loop's iterations in parallel (with every product on one thread),
+     * INTRA_ELEMENT runs them one at a time and lets every product use all the threads.
+     */
+    enum class Parallelism { INTER_ELEMENT, INTRA_ELEMENT };
+
+    /**
+     * @brief Picks inter- or intra-element parallelism for a loop over a dim x shift problem
+     *
+     * Splitting a product three ways per Karatsuba level comes with overhead (the additions and
+     * the half-size products don't quite add up to the whole), so it only pays when the loop
+     * can't keep even half the threads busy and the numbers, being at least shift bits wide, are
+     * large enough for the split to be worth spawning tasks for.
+     *
+     * @param elements number of independent iterations the loop has
+     * @param shift fixed-point shift of the numbers involved
+     */
+    inline Parallelism choose_parallelism(size_t elements, mp_bitcnt_t shift,
+                                          const IntraPolicy &policy = IntraPolicy()) {
+        const size_t threads = omp_get_max_threads();
+
+        if (2 * elements < threads && shift >= policy.min_limbs * GMP_NUMB_BITS) {
+            return Parallelism::INTRA_ELEMENT;
+        }
+        return Parallelism::INTER_ELEMENT;
+    }
+
+    namespace parallel_mul_detail {
+        /**
+         * @brief dest = a * b for a, b >= 0, spawning tasks for the first depth Karatsuba levels
+         *
+         * Unbalanced operands only have the larger one split, into two products.
+         */
+        inline void karatsuba(mpz_class &dest, const mpz_class &a, const mpz_class &b, int depth,
+                              size_t min_limbs) {
+            const size_t a_limbs = mpz_size(a.get_mpz_t());
+            const size_t b_limbs = mpz_size(b.get_mpz_t());
+
+            if (depth <= 0 || std::min(a_limbs, b_limbs) < min_limbs) {
+                mpz_mul(dest.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+                return;
+            }
+
+            const mp_bitcnt_t bits = (std::max(a_limbs, b_limbs) / 2) * GMP_NUMB_BITS;
+
+            if (2 * std::min(a_limbs, b_limbs) < std::max(a_limbs, b_limbs)) {
+                // big = hi * 2^bits + lo, so small * big is two independent products
+                const mpz_class &small = (a_limbs < b_limbs) ? a : b;
+                const mpz_class &big = (a_limbs < b_limbs) ? b : a;
+                mpz_class lo, hi, lo_product, hi_product;
+                mpz_tdiv_r_2exp(lo.get_mpz_t(), big.get_mpz_t(), bits);
+                mpz_tdiv_q_2exp(hi.get_mpz_t(), big.get_mpz_t(), bits);
+
+                #pragma omp task shared(lo_product, small, lo)
+                karatsuba(lo_product, small, lo, depth - 1, min_limbs);
+                karatsuba(hi_product, small, hi, depth - 1, min_limbs);
+                #pragma omp taskwait
+
+                mpz_mul_2exp(dest.get_mpz_t(), hi_product.get_mpz_t(), bits);
+                dest += lo_product;
+                return;
+            }
+
+            mpz_class a0, a1, b0, b1;
+            mpz_tdiv_r_2exp(a0.get_mpz_t(), a.get_mpz_t(), bits);
+            mpz_tdiv_q_2exp(a1.get_mpz_t(), a.get_mpz_t(), bits);
+            mpz_tdiv_r_2exp(b0.get_mpz_t(), b.get_mpz_t(), bits);
+            mpz_tdiv_q_2exp(b1.get_mpz_t(), b.get_mpz_t(), bits);
+
+            mpz_class z0, z1, z2;
+            mpz_class a_sum = a0 + a1;
+            mpz_class b_sum = b0 + b1;
+
+            #pragma omp task shared(z0, a0, b0)
+            karatsuba(z0, a0, b0, depth - 1, min_limbs);
+            #pragma omp task shared(z2, a1, b1)
+            karatsuba(z2, a1, b1, depth - 1, min_limbs);
+            karatsuba(z1, a_sum, b_sum, depth - 1, min_limbs);
+            #pragma omp taskwait
+
+            // a * b = z2 * 2^(2 bits) + (z1 - z0 - z2) * 2^bits + z0
+            z1 -= z0;
+            z1 -= z2;
+            mpz_mul_2exp(dest.get_mpz_t(), z2.get_mpz_t(), bits);
+            dest += z1;
+            mpz_mul_2exp(dest.get_mpz_t(), dest.get_mpz_t(), bits);
+            dest += z0;
+        }
+    }
+
+    /**
+     * @brief dest = a * b, using all the threads for operands big enough to be worth it
+     *
+     * Falls back to a plain mpz_mul when the operands are small, when only one thread is
+     * available, or when already running inside a parallel region (where the threads are busy
+     * with other elements). dest may alias a or b.
+     */
+    inline void parallel_multiply(mpz_class &dest, const mpz_class &a, const mpz_class &b,
+                                  const IntraPolicy &policy = IntraPolicy()) {
+        if (std::min(mpz_size(a.get_mpz_t()), mpz_size(b.get_mpz_t())) < policy.min_limbs
+                || omp_in_parallel() || omp_get_max_threads() <= 1) {
+            mpz_mul(dest.get_mpz_t(), a.get_mpz_t(), b.get_mpz_t());
+            return;
+        }
+
+        const int threads = omp_get_max_threads();
+
+        // Every level adds about half again to the total work, so go only as deep as there are
+        // threads to run all the leaf products at once
+        int depth = 1;
+        for (int leaves = 9; leaves <= threads; leaves *= 3) {
+            depth++;
+        }
+
+        const bool negative = (sgn(a) < 0) != (sgn(b) < 0);
+        mpz_class abs_a = abs(a);
+        mpz_class abs_b = abs(b);
+
+        #pragma omp parallel num_threads(threads)
+        #pragma omp single
+        parallel_mul_detail::karatsuba(dest, abs_a, abs_b, depth, policy.min_limbs);
+
+        if (negative) {
+            mpz_neg(dest.get_mpz_t(), dest.get_mpz_t());
+        }
+    }
+}
@@ -0,0 +1,63 @@
+/**
+ * @brief Wall time and peak resident memory of the phases of a run
+ *
+ * The phases of the dense inversion (factor, reorient, invert, assemble) scale differently with
+ * the thread count, so the total time of a run says little about which of them stops scaling
+ * first. Each phase is timed on its own, and its peak resident set is read off as memory.hpp
+ * describes.
+ *
+ * @file phases.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "memory.hpp"
+
+namespace momentmp {
+    /**
+     * @brief Time and peak resident set of one phase
+     */
+    struct PhaseRecord {
+        std::string name;
+        double seconds;
+        size_t peak_bytes;
+    };
+
+    /**
+     * @brief Time and peak resident set of each phase of a run, in the order they ran
+     *
+     * begin() starts a phase (closing the one before, if any) and end() closes it. The time spent
+     * resetting the peak is left out of the phase that follows.
+     */
+    class PhaseProfile {
+      private:
+        std::vector<PhaseRecord> phases;
+        std::string current;
+        std::chrono::steady_clock::time_point start;
+
+      public:
+        void begin(const std::string &phase) {
+            end();
+            reset_peak_resident();
+            current = phase;
+            start = std::chrono::steady_clock::now();
+        }
+
+        void end() {
+            if (!current.empty()) {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                phases.push_back({current, elapsed.count(), peak_resident_bytes()});
+                current.clear();
+            }
+        }
+
+        const std::vector<PhaseRecord> &getPhases() const {
+            return this->phases;
+        }
+    };
+}
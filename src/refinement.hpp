@@ -0,0 +1,378 @@
+/**
+ * @brief Leading columns of M^-1 by iterative refinement on a low precision factor
+ *
+ * The shift a run is given has to cover two things: the cancellation in the pivots, and the
+ * digits wanted in the result. The factorization only needs the first, yet it is the O(n^3) part,
+ * and every product in it carries the full shift on top of the thousands of bits the moments
+ * themselves grow to. Here M is instead factored at a short working shift, and equilibrated first,
+ * M' = SMS with S = diag(2^e_i) as for the floating point types (see moment_exponents()), so that
+ * its entries are at most about 1 and the factor's numbers stay about as long as the working
+ * shift. The INV_DIM columns of M^-1 are then brought up to the full shift by refinement:
+ *
+ *     r = e_c - M x          exactly, straight from the moments, in one packed product
+ *     d = S M'^-1 S r        through the working factor, O(n^2) on short numbers
+ *     x = x + d
+ *
+ * Each round gains about as many bits as the working shift has over the pivot loss, so the
+ * O(n^3) work runs on short numbers and only the residual of every round is done at full length
+ * (x is carried with some extra bits meanwhile, see headroom()).
+ *
+ * The residual is handed to the working factor scaled up to twice the working shift in bits, so
+ * it keeps its significant bits however small it has become; the correction is scaled back down
+ * by the same power of two. Refinement stops once the corrections stop shrinking, which they do at
+ * the rounding of the full shift, or short of it if the working shift was too small (which is
+ * then raised).
+ *
+ * @file refinement.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <gmpxx.h>
+#include <omp.h>
+
+#include "arithmetic.hpp"
+#include "eigen.hpp"
+#include "fixedmpz.hpp"
+#include "hankel.hpp"
+#include "kronecker.hpp"
+#include "moment_algorithm.hpp"
+#include "mpmatrix.hpp"
+#include "precision.hpp"
+
+namespace momentmp {
+    /**
+     * @brief How a refined inversion went
+     */
+    struct RefinementReport {
+        fmpz_shift_t working_shift;   ///< shift M' ended up factored at
+        size_t factorizations;        ///< times M' was factored (more than 1 if the working shift was raised)
+        size_t iterations;            ///< most rounds any one column took
+        bool converged;               ///< every column was corrected down to the rounding of the full shift
+        size_t stalled_bits;          ///< largest last correction of a column that didn't converge, in ulps
+        mpf_class last_pivot;         ///< d_(n-1) of M, from the working factor
+    };
+
+    /**
+     * @brief M' = SMS factored at a working shift, along with the exponents of S
+     */
+    struct WorkingFactor {
+        MpMatrix ldlt;                ///< L with D superimposed, column-oriented
+        std::vector<long> exponents;  ///< e_i of S = diag(2^e_i)
+        double lost;                  ///< pivot_bits_lost() of M', about log2 of its condition number
+    };
+
+    namespace refinement_detail {
+        /// Bits the correction has to shrink by each round to count as progress
+        const size_t MIN_GAIN = 2;
+
+        /// Bits a correction may have and still be down to the rounding, on top of those for cond(M')
+        const size_t ROUNDING_BITS = 8;
+
+        /// Most times the solve of one round is redone with a better guess at its gain
+        const int SOLVE_ATTEMPTS = 3;
+
+        /// number * 2^exp, truncated
+        inline mpz_class scaled(const mpz_class &number, long exp) {
+            return exp >= 0 ? mpz_class(number << exp) : mpz_class(number >> -exp);
+        }
+
+        /**
+         * @brief Bits x is carried with below the full shift while it is refined, -min(e_i) rounded
+         * up to whole limbs
+         *
+         * The entries of a column of M^-1 fall off about as fast as S does, and the working factor
+         * resolves them relative to that (in S^-1 x). An x held at the full shift would be rounded
+         * far more coarsely, relative to them, in its last rows than in its first, and the residual
+         * of that rounding alone, taken through the factor, swamps the first rows long before they
+         * reach the full shift. With these bits on, every row is held as finely as the first.
+         */
+        inline fmpz_shift_t headroom(const std::vector<long> &exponents) {
+            long lowest = 0;
+            for (auto exp : exponents) {
+                lowest = std::min(lowest, exp);
+            }
+            return fmpz_shift_t((-lowest + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS * GMP_NUMB_BITS);
+        }
+
+        /// Length in bits of the largest entry of r (0 if it is all zeros)
+        inline size_t largest_bits(const MpArray &r) {
+            size_t bits = 0;
+            for (const auto &entry : r) {
+                if (sgn(entry()) != 0) {
+                    bits = std::max(bits, mpz_sizeinbase(entry.get_mpz_t(), 2));
+                }
+            }
+            return bits;
+        }
+
+        /**
+         * @brief Size of a correction in ulps of the full shift as the working factor sees it,
+         * max(log2 |S^-1 correction|) in bits (0 if it is all zeros)
+         */
+        inline size_t correction_bits(const MpArray &correction, const std::vector<long> &exponents,
+                                      fmpz_shift_t extra) {
+            long bits = 0;
+            for (size_t i = 0; i < correction.size(); i++) {
+                if (sgn(correction[i]()) != 0) {
+                    bits = std::max(bits, long(mpz_sizeinbase(correction[i].get_mpz_t(), 2)) - exponents[i]
+                                          - long(extra));
+                }
+            }
+            return size_t(bits);
+        }
+
+        /// Outcome of refining one column on one working factor
+        struct ColumnRounds {
+            size_t iterations;
+            size_t last_correction_bits;
+            bool converged;
+        };
+
+        /**
+         * @brief Refines x towards column c of M^-1 until the corrections reach the rounding of the
+         * full shift (converged), stop shrinking before that, or max_iterations run out
+         *
+         * However exact the residual, x can only be pinned down to within some ulps, up to about
+         * cond(M'), and that is where the corrections stop shrinking: rounding noise. Corrections
+         * that stop within that many bits (the pivot loss of M') are taken to have converged, ones
+         * that stop above it to have outrun the working factor.
+         *
+         * S r is scaled by 2^a before the solve and the solution by 2^-a after, so that both the
+         * right-hand side and the solution come to at least 2 * working_shift bits and keep their
+         * significant bits however small the residual has become. That takes knowing the gain of
+         * the solve (log2 |solution| / |right-hand side|), which is taken from the same round of
+         * the column before, or failing that from the round before, and the solve is redone if
+         * that was too far off.
+         *
+         * moments, x and the residual are all at the full shift plus headroom().
+         */
+        inline ColumnRounds refine_column(const MpArray &moments, const WorkingFactor &working, size_t c,
+                                          MpArray &x, std::vector<long> &gains, size_t max_iterations) {
+            auto dim = x.size();
+            auto shift = x.getShift();
+            auto working_shift = working.ldlt.getShift();
+            const auto &exponents = working.exponents;
+            const long target = long(2 * working_shift);
+            const long margin = long(working_shift / 4);
+            const long rounding = long(working.lost) + long(ROUNDING_BITS);
+
+            MpArray r(dim, shift);
+            MpArray d(dim, working_shift);
+            MpArray correction(dim, shift);
+
+            // r = e_c - M x, kept up to date as r - M d rather than recomputed, since the
+            // corrections d get shorter every round while x doesn't
+            r[c] = number_traits<fixedmpz>::one(shift);
+            hankel_subtract_product(moments, x, r);
+
+            ColumnRounds rounds{0, SIZE_MAX, false};
+            long gain = 0;
+            while (rounds.iterations < max_iterations) {
+                // Bit length the entries of S r come to at the working shift
+                long rhs_bits = 0;
+                for (size_t i = 0; i < dim; i++) {
+                    if (sgn(r[i]()) != 0) {
+                        rhs_bits = std::max(rhs_bits, long(mpz_sizeinbase(r[i].get_mpz_t(), 2)) + exponents[i]
+                                                      + long(working_shift) - long(shift));
+                    }
+                }
+
+                if (rounds.iterations < gains.size()) {
+                    gain = gains[rounds.iterations];
+                }
+                long a = target - rhs_bits + std::max(0L, -gain) + margin;
+
+                for (int attempt = 0; attempt < SOLVE_ATTEMPTS; attempt++) {
+                    for (size_t i = 0; i < dim; i++) {
+                        d[i] = fixedmpz(scaled(r[i](), exponents[i] + a + long(working_shift) - long(shift)),
+                                        working_shift);
+                    }
+                    ldlt_solve(working.ldlt, d);
+
+                    auto solution_bits = long(largest_bits(d));
+                    if (solution_bits + long(MIN_GAIN) >= target) {
+                        gain = solution_bits - (rhs_bits + a);
+                        if (rounds.iterations < gains.size()) {
+                            gains[rounds.iterations] = gain;
+                        } else {
+                            gains.push_back(gain);
+                        }
+                        break;
+                    }
+                    a += target - solution_bits + 2 * margin;
+                }
+
+                for (size_t i = 0; i < dim; i++) {
+                    correction[i] = fixedmpz(scaled(d[i](), exponents[i] - a + long(shift) - long(working_shift)),
+                                             shift);
+                }
+
+                // A correction no smaller than the last one is noise, and is left out
+                auto bits = correction_bits(correction, exponents, headroom(exponents));
+                if (bits >= rounds.last_correction_bits) {
+                    rounds.converged = long(rounds.last_correction_bits) <= rounding;
+                    break;
+                }
+
+                for (size_t i = 0; i < dim; i++) {
+                    x[i] += correction[i];
+                }
+                hankel_subtract_product(moments, correction, r);
+                rounds.iterations++;
+                auto previous_bits = rounds.last_correction_bits;
+                rounds.last_correction_bits = bits;
+
+                if (bits <= ROUNDING_BITS || bits + MIN_GAIN > previous_bits) {
+                    rounds.converged = long(bits) <= rounding;
+                    break;
+                }
+            }
+
+            return rounds;
+        }
+    }
+
+    /**
+     * @brief Equilibration exponents for the Hankel matrix of a moment sequence
+     *
+     * e_i = -log2(M_ii) / 2 (rounded), so that M' = SMS has a diagonal of about 1, as
+     * moment_exponents() gives for the built-in moments but read off the moments themselves.
+     */
+    inline std::vector<long> hankel_exponents(const MpArray &moments, size_t dim) {
+        std::vector<long> exponents(dim);
+        for (size_t i = 0; i < dim; i++) {
+            const auto &diagonal = moments[2 * i];
+            long magnitude = 0;
+            if (sgn(diagonal()) > 0) {
+                magnitude = long(mpz_sizeinbase(diagonal.get_mpz_t(), 2)) - long(diagonal.getShift());
+            }
+            exponents[i] = -(magnitude / 2);
+        }
+        return exponents;
+    }
+
+    /**
+     * @brief Equilibrates the Hankel matrix of moments and LDLt-factors it at working_shift,
+     * raising the shift as the pivots demand
+     *
+     * The moments are at the full shift and are only rounded down to the working one. Should the
+     * pivots of M' run out of bits, the factorization starts over at the shift they suggest, up to
+     * the full shift at the most (where a PrecisionExhausted is then passed on as a plain
+     * factorization would).
+     */
+    inline WorkingFactor working_factor(const MpArray &moments, size_t dim, fmpz_shift_t &working_shift,
+                                        const KroneckerPolicy &policy = KroneckerPolicy()) {
+        auto shift = moments.getShift();
+        auto exponents = hankel_exponents(moments, dim);
+
+        while (true) {
+            working_shift = std::min(working_shift, shift);
+
+            MpMatrix ldlt(dim, working_shift, COL_ORIENTED);
+
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (size_t col = 0; col < dim; col++) {
+                for (size_t row = col; row < dim; row++) {
+                    long exp = exponents[row] + exponents[col] + long(working_shift) - long(shift);
+                    ldlt[col][row] = fixedmpz(refinement_detail::scaled(moments[row + col](), exp), working_shift);
+                }
+            }
+
+            try {
+                cholesky_decompose(ldlt, policy);
+
+                MpArray pivots(dim, working_shift);
+                extract_diagonal(ldlt, pivots, false);
+                auto lost = pivot_bits_lost(pivots);
+                return WorkingFactor{std::move(ldlt), exponents, lost};
+            } catch (const PrecisionExhausted &exhausted) {
+                if (working_shift == shift) {
+                    throw;
+                }
+                working_shift = exhausted.getSuggestedShift();
+            }
+        }
+    }
+
+    /**
+     * @brief Builds the leading block of M^-1 at the full shift by refinement on a working factor
+     *
+     * The pivots only tell whether the working shift is enough to factor M'; whether it is enough
+     * to refine with shows in the corrections, which stop shrinking short of the full shift when it
+     * isn't. M' is then factored again at twice the working shift (up to the full one), and the
+     * column carries on from where it got to.
+     *
+     * @param moments the 2 * dim - 1 moments at the full shift (M[i][j] = moments[i + j])
+     * @param working_shift shift to factor M' at first
+     * @param m_inverse receives the leading block; its dimension says how many columns to refine
+     * @param max_iterations rounds after which a column is left as it is
+     */
+    inline RefinementReport refine_inverse_block(const MpArray &moments, size_t dim, fmpz_shift_t working_shift,
+                                                 MpMatrix &m_inverse, const KroneckerPolicy &policy = KroneckerPolicy(),
+                                                 size_t max_iterations = 200) {
+        auto shift = moments.getShift();
+        auto block = std::min(m_inverse.getDim(), dim);
+
+        std::optional<WorkingFactor> working;
+        working.emplace(working_factor(moments, dim, working_shift, policy));
+
+        RefinementReport report{working_shift, 1, 0, true, 0, mpf_class()};
+        std::vector<long> gains;
+
+        // x is refined with headroom() more bits than it ends up with, and M x taken to match
+        auto extra = refinement_detail::headroom(working->exponents);
+        MpArray extended(moments.size(), shift + extra);
+        for (size_t k = 0; k < moments.size(); k++) {
+            extended[k] = fixedmpz(mpz_class(moments[k]() << extra), shift + extra);
+        }
+
+        for (size_t c = 0; c < block; c++) {
+            MpArray x(dim, shift + extra);
+
+            size_t iterations = 0;
+            while (true) {
+                auto rounds = refinement_detail::refine_column(extended, *working, c, x, gains,
+                                                               max_iterations - iterations);
+                iterations += rounds.iterations;
+
+                if (rounds.converged || working_shift == shift || iterations == max_iterations) {
+                    if (!rounds.converged) {
+                        report.converged = false;
+                        report.stalled_bits = std::max(report.stalled_bits, rounds.last_correction_bits);
+                    }
+                    break;
+                }
+
+                working_shift = std::min(2 * working_shift, shift);
+                working.emplace(working_factor(moments, dim, working_shift, policy));
+                report.factorizations++;
+                gains.clear();
+            }
+
+            for (size_t i = 0; i < block; i++) {
+                m_inverse[i][c] = fixedmpz(mpz_class(x[i]() >> extra), shift);
+            }
+            report.iterations = std::max(report.iterations, iterations);
+        }
+
+        // x_c only agrees with row c of the block to within the rounding, so make it exactly
+        // symmetric the way the other paths leave it
+        for (size_t i = 0; i < block; i++) {
+            for (size_t j = i + 1; j < block; j++) {
+                m_inverse[i][j] = m_inverse[j][i];
+            }
+        }
+
+        auto last = dim - 1;
+        report.working_shift = working_shift;
+        report.last_pivot = scaled_mpf(working->ldlt[last][last], -2 * working->exponents[last]);
+        return report;
+    }
+}
@@ -0,0 +1,238 @@
+/**
+ * @brief Small moment matrices with the dimension fixed at compile time
+ *
+ * Up to a dimension of about 64, the bigint arithmetic of a run is cheap enough that the OpenMP
+ * fork/join done for every column, and the hopping between the separately allocated columns of an
+ * MpMatrix, take up most of the time. BasicStaticMpMatrix keeps all N x N elements in one flat
+ * block and has N as a constant, so every loop bound in the kernels here is known at compile time,
+ * and none of them ever opens a parallel region. A small problem then runs start to finish on one
+ * thread, so many of them can run side by side, one per core (see run_static_batch() in main.cpp).
+ * That is what they are for: a batch is the only way into them, as a single problem on its own
+ * runs as fast through the general path, which needn't build all of L' (see invert()).
+ *
+ * The column loops are deliberately left for the compiler to unroll as it sees fit: every step is
+ * dominated by GMP calls, and unrolling all of them for all 64 sizes made for a 5 MB binary that
+ * ran slower, after three minutes of compiling.
+ *
+ * The kernels do exactly the arithmetic of cholesky_decompose(), invert() and assemble_inverse(),
+ * in the same order, so their results are bit-identical to those of the general path.
+ *
+ * @file static_matrix.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <gmpxx.h>
+
+#include "fixedmpz.hpp"
+#include "moment_algorithm.hpp"
+#include "mpmatrix.hpp"
+#include "number_traits.hpp"
+#include "precision.hpp"
+
+namespace momentmp {
+    /**
+     * @brief Largest dimension with a compile-time specialised path
+     */
+    const size_t STATIC_MAX_DIM = 64;
+
+    /**
+     * @brief An N x N matrix stored as one contiguous row-major block
+     *
+     * Orientation is down to the kernels: the factorization works on columns (as COL_ORIENTED) and
+     * the inversion on rows (as ROW_ORIENTED), and since element (i, j) is simply at i * N + j,
+     * neither needs the matrix to be reoriented first.
+     */
+    template <typename T, size_t N>
+    class BasicStaticMpMatrix {
+      private:
+        std::vector<T> elements;
+        fmpz_shift_t shift;
+      public:
+        static constexpr size_t dim = N;
+
+        explicit BasicStaticMpMatrix(fmpz_shift_t shift)
+                : elements(N * N, number_traits<T>::zero(shift)), shift(shift) {}
+
+        T &operator()(size_t row, size_t col) {
+            return elements[row * N + col];
+        }
+
+        const T &operator()(size_t row, size_t col) const {
+            return elements[row * N + col];
+        }
+
+        fmpz_shift_t getShift() const {
+            return this->shift;
+        }
+    };
+
+    template <size_t N>
+    using StaticMpMatrix = BasicStaticMpMatrix<fmp_t, N>;
+
+    namespace static_detail {
+        template <size_t First, typename F, size_t... N>
+        inline bool dispatch(size_t dim, F &&run, std::index_sequence<N...>) {
+            return ((dim == First + N && (run(std::integral_constant<size_t, First + N>()), true)) || ...);
+        }
+    }
+
+    /**
+     * @brief Calls run(N) with N = dim as a compile-time constant; returns false if dim is too large
+     */
+    template <typename F>
+    inline bool dispatch_static(size_t dim, F &&run) {
+        return static_detail::dispatch<1>(dim, std::forward<F>(run), std::make_index_sequence<STATIC_MAX_DIM>());
+    }
+
+    /**
+     * @brief Fills the lower triangle (row >= column) with the moments, built-in or given
+     *
+     * @param moments if given, M[i][j] = moments[i + j], as hankelInit() does
+     */
+    template <size_t N>
+    inline void static_moment_init(StaticMpMatrix<N> &m, const MpArray *moments = nullptr) {
+        const auto shift = m.getShift();
+
+        for (size_t col = 0; col < N; col++) {
+            for (size_t row = col; row < N; row++) {
+                if (moments) {
+                    m(row, col) = (*moments)[row + col];
+                } else {
+                    m(row, col) = factorial((2 * (row + col)) + 1);
+                    m(row, col) <<= shift + 1;
+                    m(row, col).setShift(shift);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief cholesky_decompose() for a StaticMpMatrix: L with D superimposed, in the lower triangle
+     *
+     * Every pivot goes through the same PrecisionGuard check.
+     */
+    template <size_t N>
+    inline void static_cholesky(StaticMpMatrix<N> &m, const PrecisionGuard &guard = PrecisionGuard()) {
+        size_t diagonal_bits[N];
+        for (size_t k = 0; k < N; k++) {
+            diagonal_bits[k] = mpz_sizeinbase(m(k, k).get_mpz_t(), 2);
+        }
+
+        std::vector<fixedmpz> orig(N, fixedmpz(0, m.getShift()));
+
+        for (size_t id = 0; id < N; id++) {
+            const size_t start = id + 1;
+
+            check_pivot(guard, m(id, id), diagonal_bits[id], id, N);
+
+            for (size_t row = id; row < N; row++) {
+                orig[row] = m(row, id);
+            }
+
+            if (start < N) {
+                mp_bitcnt_t precision = 0;
+                for (size_t row = start; row < N; row++) {
+                    precision = std::max(precision, mpz_sizeinbase(m(row, id).get_mpz_t(), 2));
+                }
+
+                fixedmpz_reciprocal diagonal(orig[id], precision);
+                for (size_t row = start; row < N; row++) {
+                    m(row, id) /= diagonal;
+                }
+
+                // z' = z - yx down every column to the right
+                for (size_t col = start; col < N; col++) {
+                    for (size_t row = col; row < N; row++) {
+                        m(row, col) = m(row, col) - (orig[col] * m(row, id));
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Moves the diagonal of a factored StaticMpMatrix into diagonal, leaving 1s behind
+     */
+    template <size_t N>
+    inline void static_extract_diagonal(StaticMpMatrix<N> &m, MpArray &diagonal) {
+        auto one = number_traits<fmp_t>::one(m.getShift());
+
+        for (size_t k = 0; k < N; k++) {
+            diagonal[k] = m(k, k);
+            m(k, k) = one;
+        }
+    }
+
+    /**
+     * @brief invert() for a unit lower triangular StaticMpMatrix, in place
+     */
+    template <size_t N>
+    inline void static_invert(StaticMpMatrix<N> &m) {
+        for (size_t id = 0; id < N; id++) {
+            for (size_t row = id + 1; row < N; row++) {
+                auto scale = m(row, id);
+
+                for (size_t i = 0; i < id; i++) {
+                    m(row, i) = m(row, i) - (m(id, i) * scale);
+                }
+                m(row, id) = -m(row, id);
+            }
+        }
+    }
+
+    /**
+     * @brief assemble_inverse() for a StaticMpMatrix L': the leading block of (Lt)'D'L'
+     *
+     * With N at most STATIC_MAX_DIM every sum fits in a single chunk of assemble_inverse(), so summing
+     * straight through in order gives the same result.
+     */
+    template <size_t N>
+    inline void static_assemble_inverse(const StaticMpMatrix<N> &l_inverse,
+                                        const std::vector<fixedmpz_reciprocal> &diagonal, MpMatrix &dest) {
+        auto block = std::min(dest.getDim(), N);
+
+        for (size_t i = 0; i < block; i++) {
+            for (size_t j = i; j < block; j++) {
+                fixedmpz sum(0, l_inverse.getShift());
+                for (size_t k = j; k < N; k++) {
+                    sum += l_inverse(k, i) * l_inverse(k, j) / diagonal[k];
+                }
+                dest[i][j] = sum;
+                dest[j][i] = sum;
+            }
+        }
+    }
+
+    /**
+     * @brief The whole dense fixedmpz inversion for a small M, as inversion() does it
+     *
+     * Fills the leading block of M^-1 into m_inverse and the pivots into diagonal.
+     */
+    template <size_t N>
+    inline void static_inversion(fmpz_shift_t shift, const MpArray *moments, MpArray &diagonal,
+                                 MpMatrix &m_inverse, const PrecisionGuard &guard = PrecisionGuard()) {
+        StaticMpMatrix<N> m(shift);
+        static_moment_init(m, moments);
+
+        static_cholesky(m, guard);
+        static_extract_diagonal(m, diagonal);
+        static_invert(m);
+
+        mp_bitcnt_t entry_bits = 0;
+        for (size_t k = 0; k < N; k++) {
+            for (size_t j = 0; j < m_inverse.getDim() && j < N; j++) {
+                entry_bits = std::max(entry_bits, mpz_sizeinbase(m(k, j).get_mpz_t(), 2));
+            }
+        }
+        std::vector<fixedmpz_reciprocal> reciprocals;
+        invert_diagonal(diagonal, reciprocals, 2 * entry_bits + 1);
+
+        static_assemble_inverse(m, reciprocals, m_inverse);
+    }
+}
@@ -0,0 +1,199 @@
+/**
+ * @brief Structure-aware kernels for triangular and symmetric MpMatrix products
+ *
+ * Most of what the pipeline multiplies is triangular (L, L^-1, their transposes) or symmetric (M,
+ * its inverse), so half or more of the bigint products a dense kernel would do are against known
+ * zeros, or duplicate ones already done. These kernels take the structure into account:
+ *
+ *  - trmm(): B = L B, for unit lower triangular L
+ *  - syrk(): the leading block of A D At or At D A, for lower triangular A and diagonal D
+ *  - scale_rows(): B = D B
+ *
+ * All of them work on row-oriented matrices and skip every product whose operand is a structural
+ * zero, of A or L and, where it is declared triangular, of B. Rows (or entries) are handed out to
+ * the threads (trmm() by the runtime schedule, see autotune.hpp), and every entry is always built
+ * up in the same order, so results do not depend on the number of threads.
+ *
+ * Solving against L is left to invert() (moment_algorithm.hpp), which builds L^-1 in place of L
+ * rather than into a B of its own.
+ *
+ * @file triangular.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
+#include "mpmatrix.hpp"
+#include "number_traits.hpp"
+#include "parallel_mul.hpp"
+
+namespace momentmp {
+    /**
+     * @brief Known zero pattern of an operand
+     */
+    enum class Structure { GENERAL, LOWER, UPPER };
+
+    /**
+     * @brief Which side of a symmetric product the transpose goes on
+     *
+     * NO gives A D At, YES gives At D A.
+     */
+    enum class Transpose { NO, YES };
+
+    /**
+     * @brief Whether a kernel loop over this many elements should run its iterations in parallel
+     *
+     * For fixedmpz at very high shifts and few elements, the loop is better run serially with every
+     * product spread across the threads instead (see choose_parallelism()).
+     */
+    template <typename T>
+    inline bool inter_element(size_t elements, fmpz_shift_t shift) {
+        if constexpr (number_traits<T>::fixed_point) {
+            return choose_parallelism(elements, shift) == Parallelism::INTER_ELEMENT;
+        }
+        return true;
+    }
+
+    namespace triangular_detail {
+        template <typename T>
+        inline void require_rows(const BasicMpMatrix<T> &matrix, const char *kernel) {
+            if (matrix.getMode() != ROW_ORIENTED) {
+                throw std::invalid_argument(std::string(kernel) + " needs row-oriented matrices");
+            }
+        }
+
+        /// Columns [first, last) of row k of a matrix with the given structure that can be nonzero
+        inline std::pair<size_t, size_t> nonzero_columns(Structure structure, size_t k, size_t dim) {
+            switch (structure) {
+                case Structure::LOWER: return {0, k + 1};
+                case Structure::UPPER: return {k, dim};
+                default:               return {0, dim};
+            }
+        }
+    }
+
+    /**
+     * @brief Multiplies B by L from the left in place, B = L B, with L unit lower triangular
+     *
+     * Goes up from the last row, so every row added in is still the original one: step k adds row
+     * k of B onto every row below it, in parallel. L's diagonal is taken to be 1 and never read, as
+     * extract_diagonal() leaves it, and a triangular B only has its nonzero columns touched. A lower
+     * triangular B stays lower triangular; an upper one generally fills in.
+     */
+    template <typename T>
+    inline void trmm(const BasicMpMatrix<T> &l, BasicMpMatrix<T> &b, Structure b_structure = Structure::GENERAL) {
+        triangular_detail::require_rows(l, "trmm");
+        triangular_detail::require_rows(b, "trmm");
+
+        auto dim = b.getDim();
+
+        for (size_t k = dim; k-- > 0;) {
+            auto [first, last] = triangular_detail::nonzero_columns(b_structure, k, dim);
+            const auto &sourceRow = b[k];
+
+            #pragma omp parallel for schedule(runtime) if (inter_element<T>(dim - k - 1, b.getShift()))
+            for (size_t row = k + 1; row < dim; row++) {
+                const auto &scale = l[row][k];
+                auto &destRow = b[row];
+
+                for (size_t j = first; j < last; j++) {
+                    destRow[j] = destRow[j] + (sourceRow[j] * scale);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Scales row i of B by d_i, B = D B, skipping B's structural zeros
+     */
+    template <typename T>
+    inline void scale_rows(const BasicMpArray<T> &diagonal, BasicMpMatrix<T> &b,
+                           Structure b_structure = Structure::GENERAL) {
+        triangular_detail::require_rows(b, "scale_rows");
+
+        auto dim = b.getDim();
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t row = 0; row < dim; row++) {
+            auto [first, last] = triangular_detail::nonzero_columns(b_structure, row, dim);
+            for (size_t j = first; j < last; j++) {
+                b[row][j] = b[row][j] * diagonal[row];
+            }
+        }
+    }
+
+    /**
+     * @brief Builds the leading block of a symmetric product with a lower triangular A and diagonal D
+     *
+     * With Transpose::YES the block is (At D A)[i][j] = sum over k >= max(i, j) of A[k][i] A[k][j]
+     * weighed by d_k; with Transpose::NO it is (A D At)[i][j] = sum over k <= min(i, j) of A[i][k]
+     * A[j][k] weighed by d_k. The zero terms outside those ranges are never formed, only the upper
+     * triangle of the block is computed before being mirrored, and At is read out of A rather than
+     * stored.
+     *
+     * The weighing is left to weigh(product, k), so that D can be applied as a multiplication or
+     * as a division (e.g. through cached reciprocals, to get at an inverse). It must be safe to call
+     * concurrently.
+     *
+     * Work is split into (i, j, k-chunk) tasks, each accumulating its own partial sum, and the
+     * partials of each entry are then added up in chunk order. The chunking depends only on the
+     * dimension, never on the number of threads, so the result is bit-identical however many
+     * threads run it.
+     *
+     * @param dest receives the leading dest.getDim() square block (capped at the dimension of A)
+     */
+    template <typename T, typename Weigh>
+    inline void syrk(const BasicMpMatrix<T> &a, Transpose trans, Weigh weigh, BasicMpMatrix<T> &dest,
+                     size_t chunk = 64) {
+        auto dim = a.getDim();
+        auto block = std::min(dest.getDim(), dim);
+        auto chunks = (dim + chunk - 1) / chunk;
+        auto zero = number_traits<T>::zero(a.getShift());
+
+        std::vector<std::pair<size_t, size_t>> entries;
+        for (size_t i = 0; i < block; i++) {
+            for (size_t j = i; j < block; j++) {
+                entries.emplace_back(i, j);
+            }
+        }
+
+        std::vector<T> partial(entries.size() * chunks, zero);
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t task = 0; task < partial.size(); task++) {
+            auto [i, j] = entries[task / chunks];
+
+            // i <= j, so the nonzero terms are k in [j, dim) transposed and [0, i] otherwise
+            auto first = std::max((task % chunks) * chunk, trans == Transpose::YES ? j : 0);
+            auto last = std::min((task % chunks + 1) * chunk, trans == Transpose::YES ? dim : i + 1);
+
+            auto &sum = partial[task];
+            for (size_t k = first; k < last; k++) {
+                if (trans == Transpose::YES) {
+                    sum += weigh(a[k][i] * a[k][j], k);
+                } else {
+                    sum += weigh(a[i][k] * a[j][k], k);
+                }
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1)
+        for (size_t entry = 0; entry < entries.size(); entry++) {
+            auto [i, j] = entries[entry];
+
+            auto sum = zero;
+            for (size_t c = 0; c < chunks; c++) {
+                sum += partial[entry * chunks + c];
+            }
+            dest[i][j] = sum;
+            dest[j][i] = sum;
+        }
+    }
+}
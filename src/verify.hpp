@@ -0,0 +1,290 @@
+/**
+ * @brief Randomized residual checks of a factorization and of the inverse of its L
+ *
+ * Rebuilding LDLt to compare it with M takes two O(n^3) products (see demo_multiply()). Multiplying
+ * both by a random vector x instead takes O(n^2), and a wrong factor is all but certain to show up
+ * in LDLt x - M x anyway (Freivalds' check). The same goes for L^-1: (Lt x)t L^-1 should give xt
+ * back, and for just as many of its leading columns as invert() worked out. A few vectors are
+ * enough to leave this on for every run.
+ *
+ * The check has two halves, since invert() overwrites L with L^-1: check_factor() runs on the
+ * factor, before the inversion, and keeps Lt x for each vector; check_inverse() runs on L^-1, after
+ * it. Residuals are reported as deviation_bits() does, in bits relative to the largest entry of
+ * what they are compared against.
+ *
+ * The structured solver never has L or L^-1 as a whole. Chebyshev's algorithm goes through the
+ * columns of L one by one though (scaled by the pivots, see chebyshev_recurrence()), and
+ * add_sigma_row() builds up Lt x and LDLt x from them as they go by, after which finish_rows()
+ * compares with M x. hankel_inverse_block() keeps the leading columns of L^-1, which is all
+ * check_inverse() looks at anyway.
+ *
+ * @file verify.hpp
+ * @author jwpereira
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include <gmpxx.h>
+#include <omp.h>
+
+#include "fixedmpz.hpp"
+#include "hankel.hpp"
+#include "mpmatrix.hpp"
+
+namespace momentmp {
+    namespace verify_detail {
+        /// Roughly log2(max |residual| / max |reference|), as deviation_bits() gives it
+        inline double residual_bits(const MpArray &residual, const MpArray &reference) {
+            mpz_class largest, difference;
+            for (size_t i = 0; i < residual.size(); i++) {
+                if (mpz_cmpabs(residual[i].get_mpz_t(), difference.get_mpz_t()) > 0) {
+                    difference = abs(residual[i]());
+                }
+                if (mpz_cmpabs(reference[i].get_mpz_t(), largest.get_mpz_t()) > 0) {
+                    largest = abs(reference[i]());
+                }
+            }
+            return hankel_detail::bit_gap(difference, largest);
+        }
+    }
+
+    /**
+     * @brief Freivalds-style residuals of LDLt against M, and of L^-1 against L
+     *
+     * The random vectors have entries in [-1/2, 1/2) and come from a fixed seed, so that a run
+     * checks the same vectors every time it is repeated.
+     */
+    class FactorVerifier {
+      private:
+        std::vector<MpArray> vectors;   ///< the random x
+        std::vector<MpArray> products;  ///< Lt x for each of them
+        std::vector<MpArray> sums;      ///< LDLt x for each of them, while add_sigma_row() builds it
+        double factor_bits = -std::numeric_limits<double>::infinity();
+        double inverse_bits = -std::numeric_limits<double>::infinity();
+
+        /// Folds |ldlt_x - M x| relative to |ldlt_x| into factor_bits
+        void compare_with_moments(const MpArray &ldlt_x, const MpArray &x, const MpArray &moments) {
+            auto dim = x.size();
+            auto shift = x.getShift();
+
+            // M x a row at a time, exactly, rather than through hankel_subtract_product(): this
+            // runs with all of L in memory, and the packed product would take half as much again
+            MpArray residual(ldlt_x);
+            #pragma omp parallel for schedule(dynamic, 1)
+            for (size_t i = 0; i < dim; i++) {
+                mpz_class sum, product;
+                for (size_t j = 0; j < dim; j++) {
+                    mpz_mul(product.get_mpz_t(), moments[i + j].get_mpz_t(), x[j].get_mpz_t());
+                    sum += product;
+                }
+                mpz_fdiv_q_2exp(sum.get_mpz_t(), sum.get_mpz_t(), shift);
+                residual[i]() -= sum;
+            }
+            factor_bits = std::max(factor_bits, verify_detail::residual_bits(residual, ldlt_x));
+        }
+
+        /// Folds |(Lt x)t L^-1 - xt| over the leading columns into inverse_bits, for L^-1[i][j] =
+        /// entry(i, j)
+        template <typename Fn>
+        void compare_with_vectors(size_t dim, size_t columns, fmpz_shift_t shift, Fn &&entry) {
+            for (size_t v = 0; v < products.size(); v++) {
+                const auto &x = vectors[v];
+                const auto &lt_x = products[v];
+
+                MpArray residual(columns, shift);
+                MpArray largest_terms(columns, shift);
+                #pragma omp parallel for schedule(dynamic, 1)
+                for (size_t j = 0; j < columns; j++) {
+                    fixedmpz sum = lt_x[j] - x[j];
+                    fixedmpz largest = lt_x[j];
+                    for (size_t i = j + 1; i < dim; i++) {
+                        auto term = lt_x[i] * entry(i, j);
+                        if (mpz_cmpabs(term.get_mpz_t(), largest.get_mpz_t()) > 0) {
+                            largest = term;
+                        }
+                        sum += term;
+                    }
+                    residual[j] = sum;
+                    largest_terms[j] = largest;
+                }
+                inverse_bits = std::max(inverse_bits, verify_detail::residual_bits(residual, largest_terms));
+            }
+        }
+
+      public:
+        FactorVerifier(size_t count, size_t dim, fmpz_shift_t shift, unsigned long seed = 1) {
+            gmp_randclass random(gmp_randinit_default);
+            random.seed(seed);
+
+            mpz_class half = mpz_class(1) << (shift - 1);
+            for (size_t v = 0; v < count; v++) {
+                MpArray x(dim, shift);
+                for (auto &entry : x) {
+                    entry = fixedmpz(mpz_class(random.get_z_bits(shift) - half), shift);
+                }
+                vectors.push_back(std::move(x));
+            }
+        }
+
+        /**
+         * @brief Compares LDLt x with M x for every vector, keeping Lt x for check_inverse()
+         *
+         * @param l column-oriented L; its diagonal is taken to be 1 and never read, so it may
+         *          still hold D
+         * @param diagonal D
+         * @param moments at least the 2 * dim - 1 moments M was seeded with
+         */
+        void check_factor(const MpMatrix &l, const MpArray &diagonal, const MpArray &moments) {
+            if (l.getMode() != COL_ORIENTED) {
+                throw std::invalid_argument("check_factor needs L column-oriented");
+            }
+
+            auto dim = l.getDim();
+            auto shift = l.getShift();
+            products.clear();
+
+            for (const auto &x : vectors) {
+                // Lt x and y = D Lt x, column by column of L (the rows of Lt)
+                MpArray lt_x(dim, shift);
+                MpArray y(dim, shift);
+                #pragma omp parallel for schedule(dynamic, 1)
+                for (size_t j = 0; j < dim; j++) {
+                    fixedmpz sum = x[j];
+                    for (size_t i = j + 1; i < dim; i++) {
+                        sum += l[j][i] * x[i];
+                    }
+                    y[j] = sum * diagonal[j];
+                    lt_x[j] = std::move(sum);
+                }
+                products.push_back(std::move(lt_x));
+
+                // L y, row by row
+                MpArray ldlt_x(dim, shift);
+                #pragma omp parallel for schedule(dynamic, 1)
+                for (size_t i = 0; i < dim; i++) {
+                    fixedmpz sum = y[i];
+                    for (size_t j = 0; j < i; j++) {
+                        sum += l[j][i] * y[j];
+                    }
+                    ldlt_x[i] = sum;
+                }
+
+                compare_with_moments(ldlt_x, x, moments);
+            }
+        }
+
+        /**
+         * @brief Takes in row k of the mixed moments sigma_(k,l) = d_k L[l][k] as Chebyshev's
+         * algorithm comes to it (see chebyshev_recurrence()), for the structured factorization
+         *
+         * (Lt x)_k is sigma_k . x / d_k, and adds sigma_k (Lt x)_k to LDLt x; rows have to come in
+         * order, starting from 0.
+         */
+        void add_sigma_row(size_t k, const MpArray &sigma) {
+            if (vectors.empty()) {
+                return;
+            }
+
+            auto dim = vectors.front().size();
+            auto shift = vectors.front().getShift();
+            if (k == 0) {
+                products.assign(vectors.size(), MpArray(dim, shift));
+                sums.assign(vectors.size(), MpArray(dim, shift));
+            }
+
+            const auto &pivot = sigma[k];
+            MpArray terms(dim - k, shift);
+            for (size_t v = 0; v < vectors.size(); v++) {
+                const auto &x = vectors[v];
+
+                #pragma omp parallel for schedule(static)
+                for (size_t l = k; l < dim; l++) {
+                    terms[l - k] = sigma[l] * x[l];
+                }
+                fixedmpz lt_x(0, shift);
+                for (const auto &term : terms) {
+                    lt_x += term;
+                }
+                lt_x /= pivot;
+
+                auto &ldlt_x = sums[v];
+                #pragma omp parallel for schedule(static)
+                for (size_t l = k; l < dim; l++) {
+                    ldlt_x[l] += sigma[l] * lt_x;
+                }
+                products[v][k] = std::move(lt_x);
+            }
+        }
+
+        /**
+         * @brief Compares the LDLt x built up by add_sigma_row() with M x for every vector
+         *
+         * @param moments at least the 2 * dim - 1 moments M was seeded with
+         */
+        void finish_rows(const MpArray &moments) {
+            for (size_t v = 0; v < sums.size(); v++) {
+                compare_with_moments(sums[v], vectors[v], moments);
+            }
+            sums.clear();
+        }
+
+        /**
+         * @brief Compares (Lt x)t L^-1 with xt for every vector checked by check_factor(), over the
+         * leading columns of L^-1
+         *
+         * @param l_inverse row-oriented L^-1, as invert() leaves it
+         * @param columns leading columns of l_inverse that hold L^-1 (see invert())
+         */
+        void check_inverse(const MpMatrix &l_inverse, size_t columns = SIZE_MAX) {
+            if (l_inverse.getMode() != ROW_ORIENTED) {
+                throw std::invalid_argument("check_inverse needs L^-1 row-oriented");
+            }
+
+            auto dim = l_inverse.getDim();
+            columns = std::min(columns, dim);
+            compare_with_vectors(dim, columns, l_inverse.getShift(),
+                                 [&](size_t i, size_t j) -> const fixedmpz & { return l_inverse[i][j]; });
+        }
+
+        /**
+         * @brief check_inverse() for the leading columns of L^-1 as hankel_inverse_block() leaves
+         * them, columns[k][j] = L^-1[k][j], after the rows of the factorization went through
+         * add_sigma_row()
+         */
+        void check_inverse(const std::vector<MpArray> &columns) {
+            if (columns.empty()) {
+                return;
+            }
+
+            compare_with_vectors(columns.size(), columns.front().size(), columns.front().getShift(),
+                                 [&](size_t i, size_t j) -> const fixedmpz & { return columns[i][j]; });
+        }
+
+        size_t getVectors() const {
+            return this->vectors.size();
+        }
+
+        /// Worst |LDLt x - M x| relative to |LDLt x|, in bits
+        double getFactorBits() const {
+            return this->factor_bits;
+        }
+
+        /**
+         * @brief Worst |(Lt x)t L^-1 - xt| relative to the largest term summed into it, in bits
+         *
+         * The entries of L^-1 grow by about as many bits as the pivots lose, and the rounding of
+         * Lt x grows with them, so the residual is measured against the terms that cancel to give
+         * x (relative to x itself it would only show that growth).
+         */
+        double getInverseBits() const {
+            return this->inverse_bits;
+        }
+    };
+}
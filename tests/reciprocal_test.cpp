@@ -0,0 +1,131 @@
+/**
+ * @brief Checks fixedmpz_reciprocal::newton_inverse() against GMP's exact division
+ *
+ * Divisors of up to several thousand bits are taken at random, along with exponents from just past
+ * the direct-division cutoff up to a few times the size of the divisor, or up to tens of thousands
+ * of bits for the shorter ones, and the Newton reciprocal has to come out as exactly
+ * floor(2^exponent / d). Divisors with long runs of ones or zeros (the
+ * ones most likely to throw off a truncated iteration) are mixed in with uniform ones, and powers
+ * of 2 and their neighbours are tried at exponents on either side of a doubling. Last come pivots
+ * out of an actual factorization that once sent the iteration far enough off to hang its fix-up.
+ *
+ * @file reciprocal_test.cpp
+ * @author jwpereira
+ */
+
+#include <iostream>
+#include <utility>
+
+#include <gmpxx.h>
+
+#include "fixedmpz.hpp"
+
+using namespace momentmp;
+
+namespace {
+    int failures = 0;
+
+    void check(const mpz_class &d, mp_bitcnt_t exponent) {
+        mpz_class power(1), expected;
+        power <<= exponent;
+        mpz_fdiv_q(expected.get_mpz_t(), power.get_mpz_t(), d.get_mpz_t());
+
+        if (fixedmpz_reciprocal::newton_inverse(d, exponent) != expected) {
+            std::cerr << "Mismatch: " << mpz_sizeinbase(d.get_mpz_t(), 2) << "-bit divisor, exponent "
+                      << exponent << "\n";
+            failures++;
+        }
+    }
+}
+
+int main() {
+    gmp_randstate_t random;
+    gmp_randinit_default(random);
+    gmp_randseed_ui(random, 27);
+
+    auto below = [&](unsigned long bound) {
+        mpz_class value;
+        mpz_urandomm(value.get_mpz_t(), random, mpz_class(bound).get_mpz_t());
+        return value.get_ui();
+    };
+
+    for (int trial = 0; trial < 200; trial++) {
+        mp_bitcnt_t bits = 1000 + below(15000);
+        mpz_class d;
+        if (trial % 2) {
+            mpz_rrandomb(d.get_mpz_t(), random, bits);
+        } else {
+            mpz_urandomb(d.get_mpz_t(), random, bits);
+        }
+        if (d == 0) {
+            continue;
+        }
+
+        mp_bitcnt_t n = mpz_sizeinbase(d.get_mpz_t(), 2);
+        check(d, n + 100 + below(3 * n));
+    }
+
+    // Divisors of a few hundred bits taken to exponents of tens of thousands, like the pivots of a
+    // factorization at a low shift being divided into a long column: ten or more doublings
+    for (int trial = 0; trial < 100; trial++) {
+        mp_bitcnt_t bits = 200 + below(1800);
+        mpz_class d;
+        mpz_urandomb(d.get_mpz_t(), random, bits);
+        if (d == 0) {
+            continue;
+        }
+
+        check(d, 10000 + below(30000));
+    }
+
+    // Powers of 2 and their neighbours, at exponents on either side of a doubling
+    for (mp_bitcnt_t bits : {1000, 4096, 8192}) {
+        mpz_class power(1);
+        power <<= bits - 1;
+        for (const mpz_class &d : {mpz_class(power), mpz_class(power + 1), mpz_class(2 * power - 1)}) {
+            for (mp_bitcnt_t exponent : {2 * bits, 4 * bits + 1, 16253ul}) {
+                check(d, exponent);
+            }
+        }
+    }
+
+    // Pivots of 400 x 400 at a shift of 704, with the exponents their reciprocals were taken to,
+    // that an iteration without guard bits ended up 2^62 and more away from the floor on
+    const std::pair<mp_bitcnt_t, const char *> pivots[] = {
+        {10017,
+             "864af31bfc50c9d7923749a6febefa6399d08cc569aa2be30b655a1313650072bf211d6d614328f5b264f97a"
+             "c71222923c8b99ceac9846826fbb9cc6bdd8ba64e5601ed04b84351db8315715ff8fc6a053cd169cf387b17b"
+             "71fb9e686a4a19460a0a84884e48a417e68d9949c496ef3bbaa0cea5194e8a9ab43fe38ea8fdff835abeeafb"
+             "1f5b9c0f21693e3d011badaf72ae5a57c6898ec260517bb6ae597f449b59af01cd49a747a8f52f0ef2f2919a"
+             "4e38f020dbd3045a034d15d4d0715299082cbf9a044067ba751064cedaad4b246018eb3a52ef25f55592417e"
+             "6449035ffdc3f23b60294e352b3120001a32f49d2f26247d6b8803fbbc99eb1a83b77b5034ffeac600d37bbf"
+             "083d9063f2a5f4ef51954ae9353b12e419cccea46bd72d677741c6da809170c3db59985dcd2baee280230581"
+             "ac05d4f8c19d99e1a4cbe545aa431be84d86ed6e9b006b285b51f6b04f01f145532252d07e414a753c6ba536"
+             "2a3e059e62fa9d9830fe0eef7727ee2adb304f3cf3151123b1483c0b698b431ac89f6ab3e25c7690b5f88a55"
+             "d37069b431f9c5d77bb22448e42f69e1a2fc0a95d395061d407d6c37c7a25920c17b9944b5ec2a805d3f33e6"
+             "c7d91e31f489c1a0964153dcba2f"},
+        {16253,
+             "13dd571a8a45dbf044cb85b4b3f1a505adc32c590120ab4c865cd209d505966eae2a63e1c08cf417e276a8d9"
+             "8bfa1ee035a3e75a1b624fff98a99ffbaccb3570292eb00d70d3c0f1633d8ad67279c3610e833ccb4673d144"
+             "3e378612c61427c091d83e6e6204969c1f3d4196ca23cc4f628abada02b2bd685195cdb6769ebbfd420bfdaf"
+             "92463aed4922eb338d7d44ed78ee3f8698d231821844b7b53eb93376787473a0b852dfe6edb98f4107cdb0d1"
+             "cb2c2f16187deb41de0a397881a7320daba647e0303c21df4257642e0430bfae5ba50b6e6edf808aea07306f"
+             "fc0d56da1ced2366b3414e956b6f36e5a8896c40d8f0f0d3cedb888ac7c7dd9503348479b1cdfb7835266b4b"
+             "39dcb37917974a1e827e045abdf717ca665b14cbd63da6ded3fe4921389a2864f28f1f13b4b7f8aa03f5de23"
+             "ba31ddcff47dcf0e62105714756a4fee02c04f811a46e66928516b9d8c3732c66dae20ebcd935f0ccc7f2adc"
+             "2e719f9fa6d50ad9bd91085eb16cc2f89ddf81d1291216fdd40e82cae2099ad2f56db90de141cf9bfb71f43c"
+             "84a3d5d30836a31c03eb8abd3ac48458aa008a24982599a332d2a47990e2af5c599f2628517"}
+    };
+    for (const auto &[exponent, hex] : pivots) {
+        check(mpz_class(hex, 16), exponent);
+    }
+
+    gmp_randclear(random);
+
+    if (failures > 0) {
+        std::cerr << failures << " reciprocals were off\n";
+        return 1;
+    }
+    std::cout << "All reciprocals exact\n";
+    return 0;
+}